@@ -0,0 +1,22 @@
+/*
+ *  apex_trace.c
+ *  Prints a trace recorded with trace=FILE in the per-cycle format of
+ *  verbose=1
+ *
+ *  Author :
+ *  Carolina Hernandez(cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+int main(int argc, char const* argv[])
+{
+  if (argc != 2) {
+    fprintf(stderr, "APEX_Help : Usage %s <trace_file>\n", argv[0]);
+    exit(1);
+  }
+  return APEX_trace_render(argv[1]) == 0 ? 0 : 1;
+}
@@ -0,0 +1,370 @@
+/*
+ *  batch.c
+ *  Contains the work-stealing thread pool, and the batch mode that
+ *  simulates many programs on it and prints one table of results
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/* Outcome of simulating one program */
+typedef struct Batch_Job
+{
+  char *path;
+  int loaded;       // Program parsed and CPU initialised
+  int halted;       // HALT retired before the cycle budget ran out
+  int instructions;
+  int cycles;
+  unsigned int mispredicts;
+  unsigned int stalls[NUM_STALLS];
+} Batch_Job;
+
+/*
+ * Job indices owned by one worker. The owner takes jobs from the bottom,
+ * idle workers steal from the top. Jobs never spawn jobs, so a deque
+ * only ever shrinks and a lock per deque is cheap enough for jobs that
+ * each run a whole simulation.
+ */
+typedef struct Batch_Deque
+{
+  pthread_mutex_t lock;
+  int *jobs;
+  int top;
+  int bottom;
+} Batch_Deque;
+
+typedef struct Batch_Pool
+{
+  Batch_Deque *deques;
+  int workers;
+  void (*job)(void *arg, int index);
+  void *arg;
+} Batch_Pool;
+
+typedef struct Batch_Worker
+{
+  Batch_Pool *pool;
+  int id;
+} Batch_Worker;
+
+/* What each job of a batch needs */
+typedef struct Batch_Run
+{
+  Batch_Job *jobs;
+  int no_of_cycles;
+  APEX_Config config;
+} Batch_Run;
+
+/* Takes the next job from the bottom of the worker's own deque, or -1 */
+static int
+deque_pop(Batch_Deque *deque)
+{
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top)
+  {
+    job = deque->jobs[--deque->bottom];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+/* Takes the oldest job from the top of another worker's deque, or -1 */
+static int
+deque_steal(Batch_Deque *deque)
+{
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top)
+  {
+    job = deque->jobs[deque->top++];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static void
+run_job(void *arg, int index)
+{
+  Batch_Run *run = arg;
+  Batch_Job *job = &run->jobs[index];
+  APEX_CPU *cpu = APEX_cpu_init(job->path, "Simulate", run->no_of_cycles, &run->config);
+  if (!cpu)
+  {
+    return;
+  }
+  APEX_cpu_simulate(cpu);
+  job->loaded = 1;
+  job->halted = cpu->halted;
+  job->instructions = cpu->ins_completed;
+  job->cycles = cpu->clock - cpu->start_clock;
+  job->mispredicts = cpu->bp.mispredicts;
+  memcpy(job->stalls, cpu->stalls, sizeof(job->stalls));
+  APEX_cpu_stop(cpu);
+}
+
+static void *
+worker_main(void *arg)
+{
+  Batch_Worker *worker = arg;
+  Batch_Pool *pool = worker->pool;
+
+  for (;;)
+  {
+    int job = deque_pop(&pool->deques[worker->id]);
+    for (int v = 1; job < 0 && v < pool->workers; ++v)
+    {
+      job = deque_steal(&pool->deques[(worker->id + v) % pool->workers]);
+    }
+    if (job < 0)
+    {
+      return NULL;
+    }
+    pool->job(pool->arg, job);
+  }
+}
+
+static int
+compare_paths(const void *a, const void *b)
+{
+  return strcmp(((const Batch_Job *)a)->path, ((const Batch_Job *)b)->path);
+}
+
+/* Appends path to the job list, growing it geometrically */
+static int
+add_job(Batch_Job **jobs, int *count, int *capacity, const char *path)
+{
+  if (*count == *capacity)
+  {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    Batch_Job *grown = realloc(*jobs, sizeof(**jobs) * *capacity);
+    if (!grown)
+    {
+      return -1;
+    }
+    *jobs = grown;
+  }
+  memset(&(*jobs)[*count], 0, sizeof(**jobs));
+  (*jobs)[*count].path = strdup(path);
+  return (*jobs)[(*count)++].path ? 0 : -1;
+}
+
+/*
+ * Collects the programs named by source: every .asm or assembled .bin
+ * file of a directory in name order, or else the paths listed one per
+ * line in a file. Returns the number of jobs, or -1.
+ */
+static int
+collect_jobs(const char *source, Batch_Job **jobs)
+{
+  int count = 0;
+  int capacity = 0;
+  struct stat st;
+
+  *jobs = NULL;
+  if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    DIR *dir = opendir(source);
+    struct dirent *entry;
+    char path[4096];
+    if (!dir)
+    {
+      return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+      size_t len = strlen(entry->d_name);
+      if (len > 4 && (strcmp(entry->d_name + len - 4, ".asm") == 0 ||
+                      strcmp(entry->d_name + len - 4, ".bin") == 0))
+      {
+        snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+        if (add_job(jobs, &count, &capacity, path) != 0)
+        {
+          closedir(dir);
+          return -1;
+        }
+      }
+    }
+    closedir(dir);
+    qsort(*jobs, count, sizeof(**jobs), compare_paths);
+    return count;
+  }
+
+  FILE *fp = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+  char *line = NULL;
+  size_t len = 0;
+  if (!fp)
+  {
+    return -1;
+  }
+  while (getline(&line, &len, fp) != -1)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (*line && add_job(jobs, &count, &capacity, line) != 0)
+    {
+      count = -1;
+      break;
+    }
+  }
+  free(line);
+  if (fp != stdin)
+  {
+    fclose(fp);
+  }
+  return count;
+}
+
+static void
+print_results(const Batch_Job *jobs, int count)
+{
+  long long instructions = 0;
+  long long cycles = 0;
+  int failed = 0;
+
+  printf("%-40s %-8s %12s %12s %6s %9s %9s %9s %9s %9s %9s\n", "program", "status",
+         "instructions", "cycles", "IPC", "mispred", "stall_rob", "stall_iq",
+         "stall_lsq", "stall_prf", "stall_bis");
+  for (int i = 0; i < count; ++i)
+  {
+    const Batch_Job *job = &jobs[i];
+    if (!job->loaded)
+    {
+      printf("%-40s error\n", job->path);
+      failed++;
+      continue;
+    }
+    printf("%-40s %-8s %12d %12d %6.3f %9u %9u %9u %9u %9u %9u\n", job->path,
+           job->halted ? "halted" : "stopped", job->instructions, job->cycles,
+           job->cycles ? (double)job->instructions / job->cycles : 0.0,
+           job->mispredicts, job->stalls[STALL_ROB], job->stalls[STALL_IQ],
+           job->stalls[STALL_LSQ], job->stalls[STALL_PRF], job->stalls[STALL_BIS]);
+    instructions += job->instructions;
+    cycles += job->cycles;
+  }
+  printf("%-40s %-8s %12lld %12lld %6.3f\n", "total", failed ? "errors" : "ok",
+         instructions, cycles, cycles ? (double)instructions / cycles : 0.0);
+}
+
+/*
+ * Calls job(arg, i) for every i in [0, count) on threads host threads,
+ * 0 meaning one per core, and returns once all calls have. Jobs are
+ * dealt out round robin, so stealing only has to even out jobs of
+ * different lengths. Returns the number of threads used.
+ */
+int APEX_pool_run(int count, int threads, void (*job)(void *arg, int index), void *arg)
+{
+  Batch_Pool pool;
+  pool.job = job;
+  pool.arg = arg;
+  pool.workers = threads ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool.workers > count)
+  {
+    pool.workers = count;
+  }
+  if (pool.workers < 1)
+  {
+    pool.workers = 1;
+  }
+
+  pool.deques = calloc(pool.workers, sizeof(*pool.deques));
+  int *slots = malloc(sizeof(int) * (count ? count : 1));
+  pthread_t *handles = malloc(sizeof(*handles) * pool.workers);
+  Batch_Worker *workers = malloc(sizeof(*workers) * pool.workers);
+  if (!pool.deques || !slots || !handles || !workers)
+  {
+    fprintf(stderr, "APEX_Error : Out of memory starting worker threads\n");
+    exit(1);
+  }
+  for (int w = 0, next = 0; w < pool.workers; ++w)
+  {
+    Batch_Deque *deque = &pool.deques[w];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->jobs = &slots[next];
+    for (int j = count - 1 - ((count - 1 - w) % pool.workers); j >= w; j -= pool.workers)
+    {
+      slots[next++] = j;
+    }
+    deque->bottom = &slots[next] - deque->jobs;
+  }
+
+  for (int w = 0; w < pool.workers; ++w)
+  {
+    workers[w].pool = &pool;
+    workers[w].id = w;
+    if (pthread_create(&handles[w], NULL, worker_main, &workers[w]) != 0)
+    {
+      fprintf(stderr, "APEX_Error : Unable to start worker thread\n");
+      exit(1);
+    }
+  }
+  for (int w = 0; w < pool.workers; ++w)
+  {
+    pthread_join(handles[w], NULL);
+  }
+
+  for (int w = 0; w < pool.workers; ++w)
+  {
+    pthread_mutex_destroy(&pool.deques[w].lock);
+  }
+  free(workers);
+  free(handles);
+  free(slots);
+  free(pool.deques);
+  return pool.workers;
+}
+
+/*
+ * Simulates every program named by source (see collect_jobs) for up to
+ * no_of_cycles cycles each, on config->threads host threads, and prints
+ * one row per program. Per-cycle output and the checkpoint, trace,
+ * stats and samples files are turned off. Returns 0 if every program could be loaded.
+ */
+int APEX_batch_run(const char *source, int no_of_cycles, const APEX_Config *config)
+{
+  Batch_Run run;
+  int count = collect_jobs(source, &run.jobs);
+  if (count <= 0)
+  {
+    fprintf(stderr, "APEX_Error : No programs found in %s\n", source);
+    free(run.jobs);
+    return -1;
+  }
+
+  run.no_of_cycles = no_of_cycles;
+  run.config = *config;
+  run.config.verbose = 0;
+  run.config.checkpoint[0] = '\0';
+  run.config.trace[0] = '\0';
+  run.config.stats[0] = '\0';
+  run.config.samples[0] = '\0';
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int threads = APEX_pool_run(count, config->threads, run_job, &run);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  print_results(run.jobs, count);
+
+  int failed = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    failed += !run.jobs[i].loaded;
+    free(run.jobs[i].path);
+  }
+  printf("(apex) >> Batch of %d programs on %d threads in %.3f s, %d failed\n", count,
+         threads, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         failed);
+  free(run.jobs);
+  return failed ? -1 : 0;
+}
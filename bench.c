@@ -0,0 +1,295 @@
+/*
+ *  bench.c
+ *  Contains the simulator throughput benchmark: generates synthetic APEX
+ *  programs that stress one part of the pipeline each, simulates them
+ *  with per-cycle output off and reports simulated cycles and
+ *  instructions per host second
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "cpu.h"
+
+#define BENCH_INSTRUCTIONS 1000000 // Dynamic instructions of a workload at scale 1
+#define BENCH_MAX_REPEATS 99
+
+/* A synthetic workload: writes a program whose loop body runs
+ * iterations times, and returns the length of that body
+ */
+typedef struct Bench_Workload
+{
+  const char *name;
+  int (*body_length)(void);
+  void (*write)(FILE *fp, int iterations);
+} Bench_Workload;
+
+/* Closes the loop opened after the setup code: counts R15 down and
+ * branches back over body instructions
+ */
+static void
+write_loop_end(FILE *fp, int body)
+{
+  fprintf(fp, "SUBL,R15,R15,#1\n");
+  fprintf(fp, "BNZ,#-%d\n", 4 * (body + 1));
+  fprintf(fp, "HALT\n");
+}
+
+#define ALU_BODY 240
+
+static int
+alu_body(void)
+{
+  return ALU_BODY;
+}
+
+/* Independent integer operations over R1-R12, so the integer units
+ * rather than dependences set the pace
+ */
+static void
+write_alu(FILE *fp, int iterations)
+{
+  static const char *const ops[] = {"ADD", "SUB", "AND", "OR", "EX-OR"};
+
+  for (int r = 1; r <= 12; ++r)
+  {
+    fprintf(fp, "MOVC,R%d,#%d\n", r, r * 7);
+  }
+  fprintf(fp, "MOVC,R15,#%d\n", iterations);
+  for (int i = 0; i < ALU_BODY; ++i)
+  {
+    int rd = 1 + i % 12;
+    if (i % 6 == 5)
+    {
+      fprintf(fp, "ADDL,R%d,R%d,#%d\n", rd, 1 + (i + 5) % 12, i % 32);
+    }
+    else
+    {
+      fprintf(fp, "%s,R%d,R%d,R%d\n", ops[i % 6], rd, 1 + (i + 5) % 12, 1 + (i + 7) % 12);
+    }
+  }
+  write_loop_end(fp, ALU_BODY);
+}
+
+#define MUL_CHAINS 4
+#define MUL_BODY 120
+
+static int
+mul_body(void)
+{
+  return MUL_BODY;
+}
+
+/* Interleaved chains of dependent multiplies. Multiplying by R9, which
+ * holds 1, keeps the values from overflowing.
+ */
+static void
+write_mul(FILE *fp, int iterations)
+{
+  for (int c = 1; c <= MUL_CHAINS; ++c)
+  {
+    fprintf(fp, "MOVC,R%d,#%d\n", c, c + 1);
+  }
+  fprintf(fp, "MOVC,R9,#1\n");
+  fprintf(fp, "MOVC,R15,#%d\n", iterations);
+  for (int i = 0; i < MUL_BODY; ++i)
+  {
+    int chain = 1 + i % MUL_CHAINS;
+    fprintf(fp, "MUL,R%d,R%d,R9\n", chain, chain);
+  }
+  write_loop_end(fp, MUL_BODY);
+}
+
+#define MEM_BODY 128
+
+static int
+mem_body(void)
+{
+  return MEM_BODY;
+}
+
+/* A stream of stores, each read back a few instructions later, over the
+ * first MEM_BODY words of data memory
+ */
+static void
+write_mem(FILE *fp, int iterations)
+{
+  for (int r = 1; r <= 8; ++r)
+  {
+    fprintf(fp, "MOVC,R%d,#%d\n", r, r);
+  }
+  fprintf(fp, "MOVC,R13,#0\n");
+  fprintf(fp, "MOVC,R14,#1\n");
+  fprintf(fp, "MOVC,R15,#%d\n", iterations);
+  for (int i = 0; i < MEM_BODY; i += 4)
+  {
+    fprintf(fp, "STORE,R%d,R13,#%d\n", 1 + i % 8, i);
+    fprintf(fp, "STR,R%d,R13,R14\n", 1 + (i + 1) % 8);
+    fprintf(fp, "LOAD,R%d,R13,#%d\n", 1 + (i + 2) % 8, i);
+    fprintf(fp, "LDR,R%d,R13,R14\n", 1 + (i + 3) % 8);
+  }
+  write_loop_end(fp, MEM_BODY);
+}
+
+#define BRANCH_TESTS 6
+#define BRANCH_BODY (1 + 4 * BRANCH_TESTS)
+
+static int
+branch_body(void)
+{
+  return BRANCH_BODY;
+}
+
+/* Conditional branches on bits of an iteration counter, taken in
+ * patterns of different periods
+ */
+static void
+write_branch(FILE *fp, int iterations)
+{
+  static const int masks[BRANCH_TESTS] = {1, 2, 3, 4, 6, 5};
+
+  for (int t = 0; t < BRANCH_TESTS; ++t)
+  {
+    fprintf(fp, "MOVC,R%d,#%d\n", 7 + t, masks[t]);
+  }
+  fprintf(fp, "MOVC,R1,#0\n");
+  fprintf(fp, "MOVC,R3,#0\n");
+  fprintf(fp, "MOVC,R15,#%d\n", iterations);
+  fprintf(fp, "ADDL,R3,R3,#1\n");
+  for (int t = 0; t < BRANCH_TESTS; ++t)
+  {
+    fprintf(fp, "AND,R5,R3,R%d\n", 7 + t);
+    fprintf(fp, "SUBL,R6,R5,#0\n");
+    fprintf(fp, "BZ,#8\n");
+    fprintf(fp, "ADDL,R1,R1,#1\n");
+  }
+  write_loop_end(fp, BRANCH_BODY);
+}
+
+static const Bench_Workload workloads[] = {
+    {"alu", alu_body, write_alu},
+    {"mul", mul_body, write_mul},
+    {"mem", mem_body, write_mem},
+    {"branch", branch_body, write_branch},
+};
+
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static double
+seconds_since(const struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Writes every workload to dir and simulates each repeats times on a
+ * fresh CPU. Only the simulation itself is timed; the program is decoded
+ * once. The best run gives the rate, which takes out most scheduling
+ * noise, and the median shows how steady the runs were.
+ */
+static int
+run_bench(const char *dir, int scale, int repeats)
+{
+  APEX_Config config;
+  double times[BENCH_MAX_REPEATS];
+  long long total_cycles = 0;
+  long long total_instructions = 0;
+  double total_time = 0;
+
+  APEX_config_default(&config);
+  config.verbose = 0;
+  mkdir(dir, 0777);
+
+  printf("%-8s %12s %12s %10s %10s %12s %12s\n", "workload", "instructions", "cycles",
+         "best_s", "median_s", "Mcycles/s", "MIPS");
+  for (int w = 0; w < NUM_WORKLOADS; ++w)
+  {
+    const Bench_Workload *workload = &workloads[w];
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.asm", dir, workload->name);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+      fprintf(stderr, "APEX_Error : Unable to create %s\n", path);
+      return -1;
+    }
+    workload->write(fp, (int)((long long)BENCH_INSTRUCTIONS * scale /
+                              workload->body_length()));
+    if (fclose(fp) != 0)
+    {
+      fprintf(stderr, "APEX_Error : Unable to write %s\n", path);
+      return -1;
+    }
+
+    int size;
+    APEX_Instruction *code = create_code_memory(path, &size, NULL);
+    if (!code)
+    {
+      return -1;
+    }
+
+    int cycles = 0;
+    int instructions = 0;
+    for (int r = 0; r < repeats; ++r)
+    {
+      APEX_CPU *cpu = APEX_cpu_init_code(code, size, "Simulate", 0, &config);
+      if (!cpu)
+      {
+        free(code);
+        return -1;
+      }
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      APEX_cpu_simulate(cpu);
+      times[r] = seconds_since(&start);
+      cycles = cpu->clock - cpu->start_clock;
+      instructions = cpu->ins_completed;
+      APEX_cpu_stop(cpu);
+    }
+    free(code);
+
+    qsort(times, repeats, sizeof(times[0]), compare_doubles);
+    printf("%-8s %12d %12d %10.4f %10.4f %12.3f %12.3f\n", workload->name, instructions,
+           cycles, times[0], times[repeats / 2], cycles / times[0] / 1e6,
+           instructions / times[0] / 1e6);
+    total_cycles += cycles;
+    total_instructions += instructions;
+    total_time += times[0];
+  }
+  printf("%-8s %12lld %12lld %10.4f %10s %12.3f %12.3f\n", "total", total_instructions,
+         total_cycles, total_time, "", total_cycles / total_time / 1e6,
+         total_instructions / total_time / 1e6);
+  return 0;
+}
+
+int main(int argc, char const *argv[])
+{
+  const char *dir = argc > 1 ? argv[1] : "bench";
+  int scale = argc > 2 ? atoi(argv[2]) : 1;
+  int repeats = argc > 3 ? atoi(argv[3]) : 5;
+
+  if (argc > 4 || scale < 1 || scale > 1000 || repeats < 1 || repeats > BENCH_MAX_REPEATS)
+  {
+    fprintf(stderr, "APEX_Help : Usage %s [directory] [scale 1-1000] [repeats 1-%d]\n",
+            argv[0], BENCH_MAX_REPEATS);
+    exit(1);
+  }
+  return run_bench(dir, scale, repeats) == 0 ? 0 : 1;
+}
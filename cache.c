@@ -0,0 +1,462 @@
+/*
+ *  cache.c
+ *  Contains the data cache hierarchy: set-associative L1D and L2 tag
+ *  arrays with selectable replacement, the miss status holding
+ *  registers that let L1D misses overlap, and the directory that keeps
+ *  the caches of Multicore cores coherent
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const char *const level_names[NUM_CACHE_LEVELS] = {
+    [CACHE_L1D] = "l1d", [CACHE_L2] = "l2"};
+
+static const char *const policy_names[NUM_CACHE_POLICIES] = {
+    [CACHE_LRU] = "lru", [CACHE_FIFO] = "fifo", [CACHE_RANDOM] = "random"};
+
+/* Cache_Line.used keeps the low 31 bits of APEX_Cache.tick */
+#define TICK_MASK 0x7FFFFFFFu
+
+/*
+ * Returns the APEX_Cache_Policy called name, or -1
+ */
+int APEX_cache_policy(const char *name)
+{
+  for (int p = 0; p < NUM_CACHE_POLICIES; ++p)
+  {
+    if (strcmp(name, policy_names[p]) == 0)
+    {
+      return p;
+    }
+  }
+  return -1;
+}
+
+const char *APEX_cache_policy_name(int policy)
+{
+  return policy_names[policy];
+}
+
+/*
+ * Lays the configured levels out over the shared line array, all lines
+ * empty. Returns -1 if a level does not divide into a power of two
+ * number of sets, or the levels need more lines than there are.
+ */
+int APEX_cache_init(APEX_CPU *cpu)
+{
+  const APEX_Config *config = &cpu->config;
+  APEX_Cache *cache = &cpu->cache;
+  int first = 0;
+
+  memset(cache, 0, sizeof(*cache));
+  cache->seed = 0x9E3779B9;
+  if (config->cache_words[CACHE_L2] && !config->cache_words[CACHE_L1D])
+  {
+    fprintf(stderr, "APEX_Error : l2_words needs an L1D, set l1d_words too\n");
+    return -1;
+  }
+  for (int l = 0; l < NUM_CACHE_LEVELS && config->cache_words[l]; ++l)
+  {
+    Cache_Level *level = &cache->level[l];
+    int set_words = config->cache_line[l] * config->cache_ways[l];
+    int sets = config->cache_words[l] / set_words;
+    if (config->cache_words[l] % set_words || (sets & (sets - 1)))
+    {
+      fprintf(stderr, "APEX_Error : %s_words must be a power of two times %s_ways "
+                      "lines of %s_line words, got %d\n",
+              level_names[l], level_names[l], level_names[l], config->cache_words[l]);
+      return -1;
+    }
+    if (first + sets * config->cache_ways[l] > CACHE_MAX_LINES)
+    {
+      fprintf(stderr, "APEX_Error : The data caches hold at most %d lines together\n",
+              CACHE_MAX_LINES);
+      return -1;
+    }
+    level->first = first;
+    level->sets = sets;
+    level->ways = config->cache_ways[l];
+    level->line_shift = __builtin_ctz(config->cache_line[l]);
+    first += sets * level->ways;
+    cache->levels = l + 1;
+  }
+  return 0;
+}
+
+/* Index of the first way of the set line maps to in level */
+static inline int
+level_set(const Cache_Level *level, unsigned int line)
+{
+  return level->first + (line & (level->sets - 1)) * level->ways;
+}
+
+/* Returns 1 if the line holding address is in level l */
+static int
+level_holds(const APEX_CPU *cpu, int l, unsigned int address)
+{
+  const Cache_Level *level = &cpu->cache.level[l];
+  unsigned int line = address >> level->line_shift;
+  const Cache_Line *ways = &cpu->cache.lines[level_set(level, line)];
+  for (int w = 0; w < level->ways; ++w)
+  {
+    if (ways[w].tag == line + 1)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Way of ways to fill next: an empty one if there is any, else the one
+ * the policy of level l picks
+ */
+static Cache_Line *
+level_victim(APEX_CPU *cpu, int l, Cache_Line *ways)
+{
+  APEX_Cache *cache = &cpu->cache;
+  int count = cache->level[l].ways;
+  Cache_Line *victim = &ways[0];
+  unsigned int oldest = 0;
+
+  for (int w = 0; w < count; ++w)
+  {
+    if (!ways[w].tag)
+    {
+      return &ways[w];
+    }
+  }
+  if (cpu->config.cache_policy[l] == CACHE_RANDOM)
+  {
+    /* xorshift32 */
+    cache->seed ^= cache->seed << 13;
+    cache->seed ^= cache->seed >> 17;
+    cache->seed ^= cache->seed << 5;
+    return &ways[cache->seed % count];
+  }
+  for (int w = 0; w < count; ++w)
+  {
+    unsigned int age = (cache->tick - ways[w].used) & TICK_MASK;
+    if (age > oldest)
+    {
+      victim = &ways[w];
+      oldest = age;
+    }
+  }
+  return victim;
+}
+
+/*
+ * Looks address up in level l, filling its line on a miss. Returns 1 on
+ * a hit. A dirty line the fill evicts is written back into the level
+ * below, or to memory from the last one.
+ */
+static int
+level_access(APEX_CPU *cpu, int l, unsigned int address, int write)
+{
+  APEX_Cache *cache = &cpu->cache;
+  Cache_Level *level = &cache->level[l];
+  unsigned int line = address >> level->line_shift;
+  Cache_Line *ways = &cache->lines[level_set(level, line)];
+
+  cache->tick++;
+  level->accesses++;
+  for (int w = 0; w < level->ways; ++w)
+  {
+    if (ways[w].tag == line + 1)
+    {
+      if (cpu->config.cache_policy[l] == CACHE_LRU)
+      {
+        ways[w].used = cache->tick & TICK_MASK;
+      }
+      ways[w].dirty |= write;
+      return 1;
+    }
+  }
+
+  level->misses++;
+  Cache_Line *victim = level_victim(cpu, l, ways);
+  if (victim->tag && victim->dirty)
+  {
+    level->writebacks++;
+    if (l + 1 < cache->levels)
+    {
+      level_access(cpu, l + 1, (victim->tag - 1) << level->line_shift, 1);
+    }
+  }
+  victim->tag = line + 1;
+  victim->used = cache->tick & TICK_MASK;
+  victim->dirty = write;
+  return 0;
+}
+
+/* Goes down the levels until one holds address, filling every level on
+ * the way. Returns the level that hit, cache.levels for memory.
+ */
+static int
+hierarchy_access(APEX_CPU *cpu, unsigned int address, int write)
+{
+  int l = 0;
+  /* Only the L1D line is written, the levels below fill it clean */
+  while (l < cpu->cache.levels && !level_access(cpu, l, address, write && l == 0))
+  {
+    ++l;
+  }
+  return l;
+}
+
+/* Cycles from the memory port to data found in level hit */
+static int
+hierarchy_latency(const APEX_CPU *cpu, int hit)
+{
+  int latency = 0;
+  for (int l = 0; l <= hit && l < cpu->cache.levels; ++l)
+  {
+    latency += cpu->config.cache_latency[l];
+  }
+  return hit == cpu->cache.levels ? latency + cpu->config.memory_latency : latency;
+}
+
+/* Drops the line holding address from every level. Returns 1 if any
+ * level held it.
+ */
+static int
+hierarchy_drop(APEX_CPU *cpu, unsigned int address)
+{
+  int held = 0;
+  for (int l = 0; l < cpu->cache.levels; ++l)
+  {
+    const Cache_Level *level = &cpu->cache.level[l];
+    unsigned int line = address >> level->line_shift;
+    Cache_Line *ways = &cpu->cache.lines[level_set(level, line)];
+    for (int w = 0; w < level->ways; ++w)
+    {
+      if (ways[w].tag == line + 1)
+      {
+        ways[w].tag = 0;
+        ways[w].dirty = 0;
+        held = 1;
+      }
+    }
+  }
+  return held;
+}
+
+/* Directory entry of the L1D line holding address, NULL on a single
+ * core
+ */
+static uint32_t *
+directory_entry(const APEX_CPU *cpu, unsigned int address)
+{
+  if (!cpu->shared)
+  {
+    return NULL;
+  }
+  unsigned int line = address >> cpu->cache.level[CACHE_L1D].line_shift;
+  return &cpu->shared->directory[line & (DIRECTORY_ENTRIES - 1)];
+}
+
+/* Returns 1 unless another core wrote the line of address since this
+ * one last read or wrote it
+ */
+static int
+coherent(const APEX_CPU *cpu, unsigned int address)
+{
+  const uint32_t *entry = directory_entry(cpu, address);
+  return !entry || (__atomic_load_n(entry, __ATOMIC_RELAXED) >> cpu->core & 1);
+}
+
+/* Joins the sharers of the line of address before this core reads it,
+ * dropping a copy another core has written since
+ */
+static void
+coherence_read(APEX_CPU *cpu, unsigned int address)
+{
+  uint32_t *entry = directory_entry(cpu, address);
+  if (entry && !coherent(cpu, address))
+  {
+    cpu->cache.coherence_misses += hierarchy_drop(cpu, address);
+    __atomic_fetch_or(entry, (uint32_t)1 << cpu->core, __ATOMIC_RELAXED);
+  }
+}
+
+/* Makes this core the only holder of the line of address before it
+ * writes it, invalidating the copies of every other core
+ */
+static void
+coherence_write(APEX_CPU *cpu, unsigned int address)
+{
+  uint32_t *entry = directory_entry(cpu, address);
+  if (!entry)
+  {
+    return;
+  }
+  uint32_t self = (uint32_t)1 << cpu->core;
+  uint32_t sharers = __atomic_exchange_n(entry, self, __ATOMIC_RELAXED);
+  if (!(sharers & self))
+  {
+    cpu->cache.coherence_misses += hierarchy_drop(cpu, address);
+  }
+  cpu->cache.invalidations += __builtin_popcount(sharers & ~self);
+}
+
+/* Index of the MSHR still filling L1D line, or -1 */
+static int
+mshr_find(const APEX_CPU *cpu, unsigned int line)
+{
+  for (int i = 0; i < cpu->config.mshrs; ++i)
+  {
+    if (cpu->cache.mshr[i].ready > cpu->clock && cpu->cache.mshr[i].line == line)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Index of an MSHR with no fill in flight, or -1 */
+static int
+mshr_free(const APEX_CPU *cpu)
+{
+  for (int i = 0; i < cpu->config.mshrs; ++i)
+  {
+    if (cpu->cache.mshr[i].ready <= cpu->clock)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Cycles until a load of address can start in the caches, 0 if it can
+ * now: it hits, joins a miss in flight, or finds an MSHR free
+ */
+int APEX_cache_wait(const APEX_CPU *cpu, int address)
+{
+  const APEX_Cache *cache = &cpu->cache;
+  int ready = INT_MAX;
+
+  if (!cache->levels ||
+      mshr_find(cpu, (unsigned int)address >> cache->level[CACHE_L1D].line_shift) >= 0 ||
+      (level_holds(cpu, CACHE_L1D, address) && coherent(cpu, address)))
+  {
+    return 0;
+  }
+  for (int i = 0; i < cpu->config.mshrs; ++i)
+  {
+    if (cache->mshr[i].ready <= cpu->clock)
+    {
+      return 0;
+    }
+    ready = cache->mshr[i].ready < ready ? cache->mshr[i].ready : ready;
+  }
+  return ready - cpu->clock;
+}
+
+/*
+ * Starts a load of address on the memory port this cycle. Returns the
+ * cycle its value arrives, the current one for a one-cycle hit, or -1
+ * if it misses in the L1D with every MSHR taken and has to try again.
+ */
+int APEX_cache_load(APEX_CPU *cpu, int address)
+{
+  APEX_Cache *cache = &cpu->cache;
+  if (!cache->levels)
+  {
+    return cpu->clock;
+  }
+  if (APEX_cache_wait(cpu, address))
+  {
+    return -1;
+  }
+  coherence_read(cpu, address);
+
+  /* The line is already tagged in L1D, its data is still on the way */
+  unsigned int line = (unsigned int)address >> cache->level[CACHE_L1D].line_shift;
+  int mshr = mshr_find(cpu, line);
+  if (mshr >= 0)
+  {
+    cache->level[CACHE_L1D].accesses++;
+    cache->level[CACHE_L1D].misses++;
+    cache->merged++;
+    return cache->mshr[mshr].ready;
+  }
+
+  /* APEX_cache_wait found an MSHR free for a miss */
+  int hit = hierarchy_access(cpu, address, 0);
+  int ready = cpu->clock + hierarchy_latency(cpu, hit) - 1;
+  if (hit != CACHE_L1D)
+  {
+    mshr = mshr_free(cpu);
+    cache->mshr[mshr].line = line;
+    cache->mshr[mshr].ready = ready;
+  }
+  return ready;
+}
+
+/*
+ * Writes address into the L1D as a store retires, allocating its line on
+ * a miss. Stores drain without holding up commit; a miss takes an MSHR
+ * if one is free, so loads of the line wait for the fill.
+ */
+void APEX_cache_store(APEX_CPU *cpu, int address)
+{
+  APEX_Cache *cache = &cpu->cache;
+  if (!cache->levels)
+  {
+    return;
+  }
+  coherence_write(cpu, address);
+  unsigned int line = (unsigned int)address >> cache->level[CACHE_L1D].line_shift;
+  int mshr = mshr_find(cpu, line) < 0 ? mshr_free(cpu) : -1;
+  int hit = hierarchy_access(cpu, address, 1);
+  if (hit != CACHE_L1D && mshr >= 0)
+  {
+    cache->mshr[mshr].line = line;
+    cache->mshr[mshr].ready = cpu->clock + hierarchy_latency(cpu, hit) - 1;
+  }
+}
+
+void APEX_cache_reset_stats(APEX_CPU *cpu)
+{
+  APEX_Cache *cache = &cpu->cache;
+  for (int l = 0; l < NUM_CACHE_LEVELS; ++l)
+  {
+    cache->level[l].accesses = 0;
+    cache->level[l].misses = 0;
+    cache->level[l].writebacks = 0;
+  }
+  cache->merged = 0;
+  cache->mshr_stalls = 0;
+  cache->coherence_misses = 0;
+  cache->invalidations = 0;
+}
+
+/*
+ * Prints the hit rate of every cache level and how the MSHRs fared
+ */
+void APEX_cache_print_stats(const APEX_CPU *cpu)
+{
+  const APEX_Cache *cache = &cpu->cache;
+  for (int l = 0; l < cache->levels; ++l)
+  {
+    const Cache_Level *level = &cache->level[l];
+    printf("(apex) >> %s %dx%dx%d %s: %.2f%% hit rate over %u accesses, %u writebacks\n",
+           l == CACHE_L1D ? "L1D" : "L2", level->sets, level->ways, 1 << level->line_shift,
+           policy_names[cpu->config.cache_policy[l]],
+           level->accesses ? 100.0 * (level->accesses - level->misses) / level->accesses : 0.0,
+           level->accesses, level->writebacks);
+  }
+  if (cache->levels)
+  {
+    printf("(apex) >> MSHRs: %u misses merged, %u cycles a load found them all taken\n",
+           cache->merged, cache->mshr_stalls);
+  }
+}
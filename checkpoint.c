@@ -0,0 +1,198 @@
+/*
+ *  checkpoint.c
+ *  Contains saving the complete simulator state to a binary checkpoint
+ *  file and restoring it
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+static const char checkpoint_magic[8] = "APEXCKPT";
+
+/*
+ * Checkpoint file layout: this header, the APEX_CPU image, the decoded
+ * code memory, then every allocated data memory page as its page number
+ * followed by its PAGE_WORDS words. The header is padded to 64 bytes so
+ * the CPU image keeps the alignment of its pipeline latches within the
+ * file.
+ */
+typedef struct Checkpoint_Header
+{
+  char magic[8];
+  uint32_t version;           // APEX_CHECKPOINT_VERSION
+  uint32_t cpu_size;          // sizeof(APEX_CPU) of the writer
+  uint32_t instruction_size;  // sizeof(APEX_Instruction) of the writer
+  uint32_t code_memory_size;  // Instructions following the CPU image
+  uint32_t pages;             // Data memory pages following the code memory
+  uint8_t pad[36];
+} Checkpoint_Header;
+
+_Static_assert(sizeof(Checkpoint_Header) == 64, "checkpoint header must stay 64 bytes");
+
+/* Bytes of one saved data memory page */
+#define PAGE_RECORD_SIZE (sizeof(int32_t) + sizeof(int) * PAGE_WORDS)
+
+/* Appends one data memory page to the checkpoint open as arg */
+static int
+save_page(void *arg, int number, const int *page)
+{
+  FILE *fp = arg;
+  int32_t n = number;
+  if (fwrite(&n, sizeof(n), 1, fp) != 1 || fwrite(page, sizeof(int), PAGE_WORDS, fp) != PAGE_WORDS)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Writes the complete state of cpu to filename. Returns 0 on success.
+ */
+int APEX_cpu_save(const APEX_CPU *cpu, const char *filename)
+{
+  Checkpoint_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+  header.version = APEX_CHECKPOINT_VERSION;
+  header.cpu_size = sizeof(APEX_CPU);
+  header.instruction_size = sizeof(APEX_Instruction);
+  header.code_memory_size = cpu->code_memory_size;
+  header.pages = cpu->memory.pages;
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create checkpoint %s\n", filename);
+    return -1;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(cpu, sizeof(*cpu), 1, fp) == 1 &&
+           fwrite(cpu->code_memory, sizeof(APEX_Instruction),
+                  cpu->code_memory_size, fp) == (size_t)cpu->code_memory_size &&
+           APEX_memory_pages(&cpu->memory, save_page, fp) == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write checkpoint %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Maps the checkpoint in filename and rebuilds the CPU it holds, code
+ * memory included, so the program is not parsed again. The restored CPU
+ * runs no_of_cycles more cycles (0 until HALT) and its statistics start
+ * from zero. Returns NULL if the file is not a checkpoint written by
+ * this version of the simulator.
+ */
+APEX_CPU *
+APEX_cpu_restore(const char *filename, int no_of_cycles)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open checkpoint %s\n", filename);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Checkpoint_Header))
+  {
+    fprintf(stderr, "APEX_Error : %s is not an APEX checkpoint\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    fprintf(stderr, "APEX_Error : Unable to map checkpoint %s\n", filename);
+    return NULL;
+  }
+
+  const Checkpoint_Header *header = map;
+  const char *image = (const char *)map + sizeof(*header);
+  APEX_CPU *cpu = NULL;
+
+  if (memcmp(header->magic, checkpoint_magic, sizeof(header->magic)) != 0)
+  {
+    fprintf(stderr, "APEX_Error : %s is not an APEX checkpoint\n", filename);
+  }
+  else if (header->version != APEX_CHECKPOINT_VERSION ||
+           header->cpu_size != sizeof(APEX_CPU) ||
+           header->instruction_size != sizeof(APEX_Instruction))
+  {
+    fprintf(stderr, "APEX_Error : Checkpoint %s was written by version %u of "
+                    "the simulator, this is version %d\n",
+            filename, header->version, APEX_CHECKPOINT_VERSION);
+  }
+  else if ((size_t)st.st_size != sizeof(*header) + sizeof(APEX_CPU) +
+                                      (size_t)header->code_memory_size *
+                                          sizeof(APEX_Instruction) +
+                                      (size_t)header->pages * PAGE_RECORD_SIZE)
+  {
+    fprintf(stderr, "APEX_Error : Checkpoint %s is truncated\n", filename);
+  }
+  else if ((cpu = aligned_alloc(64, sizeof(*cpu))) != NULL)
+  {
+    memcpy(cpu, image, sizeof(*cpu));
+    cpu->code_memory = malloc(header->code_memory_size * sizeof(APEX_Instruction));
+    if (!cpu->code_memory)
+    {
+      free(cpu);
+      cpu = NULL;
+    }
+    else
+    {
+      memcpy(cpu->code_memory, image + sizeof(*cpu),
+             header->code_memory_size * sizeof(APEX_Instruction));
+      cpu->code_memory_size = header->code_memory_size;
+      cpu->code_mapped = 0;
+      cpu->code_borrowed = 0;
+      cpu->fast_forwarded = 0;
+      cpu->max_cycles = no_of_cycles > 0 ? cpu->clock - 1 + no_of_cycles : 0;
+      cpu->config.checkpoint[0] = '\0';
+      cpu->config.trace[0] = '\0';
+      cpu->config.stats[0] = '\0';
+      cpu->config.samples[0] = '\0';
+      cpu->trace = NULL;
+      cpu->samples = NULL;
+      cpu->shared = NULL;
+      cpu->core = 0;
+      APEX_cpu_reset_stats(cpu);
+
+      /* The page table in the image points into the writer's heap */
+      const char *record = image + sizeof(*cpu) +
+                           header->code_memory_size * sizeof(APEX_Instruction);
+      APEX_memory_init(&cpu->memory, cpu->config.memory_words);
+      for (uint32_t p = 0; cpu && p < header->pages; ++p, record += PAGE_RECORD_SIZE)
+      {
+        int32_t number;
+        memcpy(&number, record, sizeof(number));
+        if (APEX_memory_load_page(&cpu->memory, number,
+                                  (const int *)(record + sizeof(number))) != 0)
+        {
+          fprintf(stderr, "APEX_Error : Checkpoint %s is corrupt\n", filename);
+          APEX_cpu_stop(cpu);
+          cpu = NULL;
+        }
+      }
+    }
+  }
+
+  munmap(map, st.st_size);
+  return cpu;
+}
@@ -0,0 +1,457 @@
+/*
+ *  config.c
+ *  Contains the runtime microarchitecture configuration, set from
+ *  key=value pairs on the command line
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/*
+ * Fills config with the compile-time defaults from cpu.h
+ */
+void APEX_config_default(APEX_Config *config)
+{
+  memset(config, 0, sizeof(*config));
+  config->verbose = ENABLE_DEBUG_MESSAGES;
+  config->iq_entries = IQ_ENTRIES;
+  config->lsq_entries = LSQ_ENTRIES;
+  config->prf_regs = PRF_REGS;
+  config->rob_entries = ROB_ENTRIES;
+  config->bis_entries = BIS_ENTRIES;
+  config->fu_units[FU_INT] = INT_UNITS;
+  config->fu_latency[FU_INT] = INT_LATENCY;
+  config->fu_units[FU_MUL] = MUL_UNITS;
+  config->fu_latency[FU_MUL] = MUL_LATENCY;
+  config->fu_units[FU_BR] = BR_UNITS;
+  config->fu_latency[FU_BR] = BR_LATENCY;
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    config->fu_pipelined[fu] = 1;
+  }
+  config->fetch_width = FETCH_WIDTH;
+  config->fetch_buffer = FETCH_BUFFER;
+  config->decode_width = DECODE_WIDTH;
+  config->issue_width = ISSUE_WIDTH;
+  config->commit_width = COMMIT_WIDTH;
+  config->predictor = PRED_STATIC;
+  config->btb_sets = BTB_SETS;
+  config->btb_ways = BTB_WAYS;
+  config->pht_bits = PHT_BITS;
+  config->interval = SAMPLE_INTERVAL;
+  config->memory_words = DATA_MEMORY_SIZE;
+  config->cache_words[CACHE_L1D] = L1D_WORDS;
+  config->cache_ways[CACHE_L1D] = L1D_WAYS;
+  config->cache_line[CACHE_L1D] = L1D_LINE;
+  config->cache_latency[CACHE_L1D] = L1D_LATENCY;
+  config->cache_words[CACHE_L2] = L2_WORDS;
+  config->cache_ways[CACHE_L2] = L2_WAYS;
+  config->cache_line[CACHE_L2] = L2_LINE;
+  config->cache_latency[CACHE_L2] = L2_LATENCY;
+  config->memory_latency = MEMORY_LATENCY;
+  config->mshrs = MSHRS;
+  config->uop_cache = UOP_CACHE;
+  config->cores = CORES;
+  config->quantum = QUANTUM;
+  config->core_reg = CORE_REG;
+  config->smt_threads = SMT_THREADS;
+  config->fetch_policy = FETCH_ROUND_ROBIN;
+}
+
+/*
+ * Parses value as an integer within [min, max]
+ */
+static int
+parse_int(const char *key, const char *value, int min, int max, int *out)
+{
+  char *end;
+  long v = strtol(value, &end, 0);
+  if (*value == '\0' || *end != '\0' || v < min || v > max)
+  {
+    fprintf(stderr, "APEX_Error : %s must be an integer in [%d, %d], got '%s'\n",
+            key, min, max, value);
+    return -1;
+  }
+  *out = (int)v;
+  return 0;
+}
+
+/*
+ * Parses value as a power of two within [min, max]
+ */
+static int
+parse_power_of_two(const char *key, const char *value, int min, int max, int *out)
+{
+  int v;
+  if (parse_int(key, value, min, max, &v) != 0)
+  {
+    return -1;
+  }
+  if (v & (v - 1))
+  {
+    fprintf(stderr, "APEX_Error : %s must be a power of two, got %d\n", key, v);
+    return -1;
+  }
+  *out = v;
+  return 0;
+}
+
+/*
+ * Copies value into the size-byte file name buffer out
+ */
+static int
+parse_file_name(const char *key, const char *value, char *out, size_t size)
+{
+  if (*value == '\0' || strlen(value) >= size)
+  {
+    fprintf(stderr, "APEX_Error : %s needs a file name shorter than %zu characters\n",
+            key, size);
+    return -1;
+  }
+  strcpy(out, value);
+  return 0;
+}
+
+/* Functional unit classes with <name>_units and <name>_latency keys */
+static const char *const fu_names[NUM_FU_CLASSES] = {
+    [FU_INT] = "int", [FU_MUL] = "mul", [FU_BR] = "br"};
+
+/* Data cache levels with <name>_words, _ways, _line, _latency and
+ * _policy keys
+ */
+static const char *const cache_names[NUM_CACHE_LEVELS] = {
+    [CACHE_L1D] = "l1d", [CACHE_L2] = "l2"};
+
+/*
+ * Sets the parameter named suffix of cache level l
+ */
+static int
+set_cache(APEX_Config *config, int l, const char *suffix, const char *key, const char *value)
+{
+  if (strcmp(suffix, "words") == 0)
+  {
+    return parse_int(key, value, 0, CACHE_MAX_LINES * CACHE_MAX_LINE_WORDS,
+                     &config->cache_words[l]);
+  }
+  if (strcmp(suffix, "ways") == 0)
+  {
+    return parse_int(key, value, 1, CACHE_MAX_WAYS, &config->cache_ways[l]);
+  }
+  if (strcmp(suffix, "line") == 0)
+  {
+    return parse_power_of_two(key, value, 1, CACHE_MAX_LINE_WORDS, &config->cache_line[l]);
+  }
+  if (strcmp(suffix, "latency") == 0)
+  {
+    return parse_int(key, value, 1, CACHE_MAX_LATENCY, &config->cache_latency[l]);
+  }
+  if (strcmp(suffix, "policy") == 0)
+  {
+    int policy = APEX_cache_policy(value);
+    if (policy < 0)
+    {
+      fprintf(stderr, "APEX_Error : Unknown replacement policy '%s', expected lru, "
+                      "fifo or random\n",
+              value);
+      return -1;
+    }
+    config->cache_policy[l] = policy;
+    return 0;
+  }
+  fprintf(stderr, "APEX_Error : Unknown configuration key '%s'\n", key);
+  return -1;
+}
+
+/*
+ * Sets one configuration parameter by name. Returns 0 on success and
+ * -1 for an unknown key or an invalid value.
+ */
+int APEX_config_set(APEX_Config *config, const char *key, const char *value)
+{
+  if (strcmp(key, "verbose") == 0)
+  {
+    return parse_int(key, value, 0, 1, &config->verbose);
+  }
+  if (strcmp(key, "threads") == 0)
+  {
+    return parse_int(key, value, 0, 1024, &config->threads);
+  }
+  if (strcmp(key, "cores") == 0)
+  {
+    return parse_int(key, value, 0, CORES_MAX, &config->cores);
+  }
+  if (strcmp(key, "quantum") == 0)
+  {
+    return parse_int(key, value, 1, QUANTUM_MAX, &config->quantum);
+  }
+  if (strcmp(key, "core_reg") == 0)
+  {
+    return parse_int(key, value, 0, ARF - 1, &config->core_reg);
+  }
+  if (strcmp(key, "smt_threads") == 0)
+  {
+    return parse_int(key, value, 1, SMT_MAX, &config->smt_threads);
+  }
+  if (strcmp(key, "fetch_policy") == 0)
+  {
+    int policy = APEX_fetch_policy(value);
+    if (policy < 0)
+    {
+      fprintf(stderr, "APEX_Error : Unknown fetch policy '%s', expected round_robin "
+                      "or icount\n",
+              value);
+      return -1;
+    }
+    config->fetch_policy = policy;
+    return 0;
+  }
+  if (strcmp(key, "config") == 0)
+  {
+    return APEX_config_load(config, value);
+  }
+  if (strcmp(key, "iq_entries") == 0)
+  {
+    return parse_int(key, value, 1, IQ_MAX_ENTRIES, &config->iq_entries);
+  }
+  if (strcmp(key, "lsq_entries") == 0)
+  {
+    return parse_power_of_two(key, value, 1, LSQ_MAX_ENTRIES, &config->lsq_entries);
+  }
+  if (strcmp(key, "prf_regs") == 0)
+  {
+    /* At least one register beyond the initial R0-R15 and zero flag
+     * mappings, or nothing could ever be renamed
+     */
+    return parse_int(key, value, RAT_Entries + 1, PRF_MAX, &config->prf_regs);
+  }
+  if (strcmp(key, "rob_entries") == 0)
+  {
+    return parse_power_of_two(key, value, 2, ROB_MAX_ENTRIES, &config->rob_entries);
+  }
+  if (strcmp(key, "bis_entries") == 0)
+  {
+    return parse_int(key, value, 1, BIS_MAX_ENTRIES, &config->bis_entries);
+  }
+  if (strcmp(key, "memory_words") == 0)
+  {
+    return parse_power_of_two(key, value, PAGE_WORDS, DATA_MEMORY_MAX_WORDS,
+                              &config->memory_words);
+  }
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    size_t len = fu_names[fu] ? strlen(fu_names[fu]) : 0;
+    if (len && strncmp(key, fu_names[fu], len) == 0 && key[len] == '_')
+    {
+      if (strcmp(key + len + 1, "units") == 0)
+      {
+        return parse_int(key, value, 1, FU_MAX_UNITS, &config->fu_units[fu]);
+      }
+      if (strcmp(key + len + 1, "latency") == 0)
+      {
+        return parse_int(key, value, 1, FU_MAX_LATENCY, &config->fu_latency[fu]);
+      }
+      if (strcmp(key + len + 1, "pipelined") == 0)
+      {
+        return parse_int(key, value, 0, 1, &config->fu_pipelined[fu]);
+      }
+    }
+  }
+  for (int l = 0; l < NUM_CACHE_LEVELS; ++l)
+  {
+    size_t len = strlen(cache_names[l]);
+    if (strncmp(key, cache_names[l], len) == 0 && key[len] == '_')
+    {
+      return set_cache(config, l, key + len + 1, key, value);
+    }
+  }
+  if (strcmp(key, "memory_latency") == 0)
+  {
+    return parse_int(key, value, 1, CACHE_MAX_LATENCY, &config->memory_latency);
+  }
+  if (strcmp(key, "mshrs") == 0)
+  {
+    return parse_int(key, value, 1, MSHR_MAX, &config->mshrs);
+  }
+  if (strcmp(key, "uop_cache") == 0)
+  {
+    return parse_power_of_two(key, value, 0, UOP_CACHE_MAX, &config->uop_cache);
+  }
+  if (strcmp(key, "fetch_width") == 0)
+  {
+    return parse_int(key, value, 1, WIDTH_MAX, &config->fetch_width);
+  }
+  if (strcmp(key, "fetch_buffer") == 0)
+  {
+    return parse_int(key, value, 0, FETCH_BUFFER_MAX, &config->fetch_buffer);
+  }
+  if (strcmp(key, "decode_width") == 0)
+  {
+    return parse_int(key, value, 1, WIDTH_MAX, &config->decode_width);
+  }
+  if (strcmp(key, "issue_width") == 0)
+  {
+    return parse_int(key, value, 1, FU_MAX_COUNT, &config->issue_width);
+  }
+  if (strcmp(key, "commit_width") == 0)
+  {
+    return parse_int(key, value, 1, ROB_MAX_ENTRIES, &config->commit_width);
+  }
+  if (strcmp(key, "predictor") == 0)
+  {
+    int kind = APEX_predictor_kind(value);
+    if (kind < 0)
+    {
+      fprintf(stderr, "APEX_Error : Unknown predictor '%s', expected static, "
+                      "bimodal, gshare or tage\n",
+              value);
+      return -1;
+    }
+    config->predictor = kind;
+    return 0;
+  }
+  if (strcmp(key, "btb_sets") == 0)
+  {
+    int sets;
+    if (parse_int(key, value, 1, BTB_MAX_SETS, &sets) != 0)
+    {
+      return -1;
+    }
+    if (sets & (sets - 1))
+    {
+      fprintf(stderr, "APEX_Error : btb_sets must be a power of two, got %d\n", sets);
+      return -1;
+    }
+    config->btb_sets = sets;
+    return 0;
+  }
+  if (strcmp(key, "btb_ways") == 0)
+  {
+    return parse_int(key, value, 1, BTB_MAX_WAYS, &config->btb_ways);
+  }
+  if (strcmp(key, "pht_bits") == 0)
+  {
+    return parse_int(key, value, 1, PHT_MAX_BITS, &config->pht_bits);
+  }
+  if (strcmp(key, "skip_idle") == 0)
+  {
+    return parse_int(key, value, 0, 1, &config->skip_idle);
+  }
+  if (strcmp(key, "ff_insns") == 0)
+  {
+    return parse_int(key, value, 0, INT_MAX, &config->ff_insns);
+  }
+  if (strcmp(key, "ff_pc") == 0)
+  {
+    return parse_int(key, value, 0, INT_MAX, &config->ff_pc);
+  }
+  if (strcmp(key, "checkpoint") == 0)
+  {
+    return parse_file_name(key, value, config->checkpoint, sizeof(config->checkpoint));
+  }
+  if (strcmp(key, "trace") == 0)
+  {
+    return parse_file_name(key, value, config->trace, sizeof(config->trace));
+  }
+  if (strcmp(key, "stats") == 0)
+  {
+    return parse_file_name(key, value, config->stats, sizeof(config->stats));
+  }
+  if (strcmp(key, "samples") == 0)
+  {
+    return parse_file_name(key, value, config->samples, sizeof(config->samples));
+  }
+  if (strcmp(key, "interval") == 0)
+  {
+    return parse_int(key, value, 1, INT_MAX, &config->interval);
+  }
+
+  fprintf(stderr, "APEX_Error : Unknown configuration key '%s'\n", key);
+  return -1;
+}
+
+/* Strips leading and trailing blanks */
+static char *
+trim(char *token)
+{
+  while (*token == ' ' || *token == '\t')
+  {
+    ++token;
+  }
+  size_t len = strlen(token);
+  while (len && strchr(" \t\r\n", token[len - 1]))
+  {
+    token[--len] = '\0';
+  }
+  return token;
+}
+
+/*
+ * Applies the key=value lines of filename to config. Blank lines and
+ * anything after '#' are ignored. Returns 0 on success.
+ */
+int APEX_config_load(APEX_Config *config, const char *filename)
+{
+  FILE *fp = fopen(filename, "r");
+  char *line = NULL;
+  size_t len = 0;
+  int line_number = 0;
+  int status = 0;
+
+  if (!fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open configuration %s\n", filename);
+    return -1;
+  }
+  while (status == 0 && getline(&line, &len, fp) != -1)
+  {
+    line_number++;
+    line[strcspn(line, "#")] = '\0';
+    char *key = trim(line);
+    char *eq = strchr(key, '=');
+    if (*key == '\0')
+    {
+      continue;
+    }
+    if (!eq || eq == key)
+    {
+      fprintf(stderr, "APEX_Error : %s:%d: expected key=value, got '%s'\n", filename,
+              line_number, key);
+      status = -1;
+      break;
+    }
+    *eq = '\0';
+    status = APEX_config_set(config, trim(key), trim(eq + 1));
+    if (status != 0)
+    {
+      fprintf(stderr, "APEX_Error : Invalid setting at %s:%d\n", filename, line_number);
+    }
+  }
+  free(line);
+  fclose(fp);
+  return status;
+}
+
+/*
+ * Returns 1 if a and b size the pipeline structures and caches
+ * identically, so that the state of a CPU built with one is valid under
+ * the other
+ */
+int APEX_config_same_shape(const APEX_Config *a, const APEX_Config *b)
+{
+  return a->iq_entries == b->iq_entries && a->lsq_entries == b->lsq_entries &&
+         a->prf_regs == b->prf_regs && a->rob_entries == b->rob_entries &&
+         a->bis_entries == b->bis_entries && a->memory_words == b->memory_words &&
+         a->smt_threads == b->smt_threads &&
+         memcmp(a->fu_units, b->fu_units, sizeof(a->fu_units)) == 0 &&
+         memcmp(a->fu_latency, b->fu_latency, sizeof(a->fu_latency)) == 0 &&
+         memcmp(a->cache_words, b->cache_words, sizeof(a->cache_words)) == 0 &&
+         memcmp(a->cache_ways, b->cache_ways, sizeof(a->cache_ways)) == 0 &&
+         memcmp(a->cache_line, b->cache_line, sizeof(a->cache_line)) == 0;
+}
@@ -6,87 +6,244 @@
  *  Carolina Hernandez (cherna19@binghamton.edu)
  *  State University of New York, Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cpu.h"
 
-/* Set this flag to 1 to enable debug messages */
-#define ENABLE_DEBUG_MESSAGES 1
-int flush_and_reload_pc = 0;
+
+#define BIT(i) ((uint64_t)1 << (i))
+#define ctz(x) __builtin_ctzll(x)
+
+/* Mask with the low n bits set */
+static inline uint64_t
+low_mask(int n)
+{
+  return n >= 64 ? ~(uint64_t)0 : BIT(n) - 1;
+}
+
+/* Lays out the latches of the functional units after the fixed stages.
+ * Branch units come first, then multipliers, then integer units, which
+ * is the order execute() clocks them in.
+ */
+static void
+fu_layout(APEX_CPU *cpu)
+{
+  static const int order[] = {FU_BR, FU_MUL, FU_INT};
+  int s = NUM_STAGES;
+
+  cpu->num_fus = 0;
+  for (size_t c = 0; c < sizeof(order) / sizeof(order[0]); ++c)
+  {
+    for (int u = 0; u < cpu->config.fu_units[order[c]]; ++u)
+    {
+      APEX_FU *fu = &cpu->fu[cpu->num_fus++];
+      fu->fu = order[c];
+      fu->unit = u;
+      fu->first = s;
+      fu->latency = cpu->config.fu_latency[order[c]];
+      s += fu->latency;
+    }
+  }
+  cpu->num_stages = s;
+}
 
 /*
- * This function creates and initializes APEX cpu.
- *
- * Note : You are free to edit this function according to your
- * 				implementation
+ * Allocates a CPU in its reset state, without code memory. Returns NULL
+ * if command is not Simulate or Fastforward.
  */
-APEX_CPU *
-APEX_cpu_init(const char *filename, const char *command, int no_of_cycles)
+static APEX_CPU *
+cpu_create(const char *command, int no_of_cycles, const APEX_Config *config)
 {
-  if (!filename && !command && !no_of_cycles)
+  APEX_CPU *cpu = aligned_alloc(64, sizeof(*cpu));
+  if (!cpu)
   {
     return NULL;
   }
+  memset(cpu, 0, sizeof(*cpu));
 
-  APEX_CPU *cpu = malloc(sizeof(*cpu));
-  if (!cpu)
+  if (config)
   {
+    cpu->config = *config;
+  }
+  else
+  {
+    APEX_config_default(&cpu->config);
+  }
+
+  /* Simulate runs the pipeline from the first instruction, Fastforward
+   * interprets up to ff_insns instructions or to ff_pc first
+   */
+  int fast_forward = strcmp(command, "Fastforward") == 0;
+  if (!fast_forward && strcmp(command, "Simulate") != 0)
+  {
+    fprintf(stderr, "APEX_Error : Unknown command '%s', expected Simulate or Fastforward\n",
+            command);
+    free(cpu);
+    return NULL;
+  }
+  if (fast_forward && !cpu->config.ff_insns && !cpu->config.ff_pc)
+  {
+    fprintf(stderr, "APEX_Error : Fastforward needs ff_insns=N or ff_pc=ADDRESS\n");
+    free(cpu);
     return NULL;
   }
 
-  if (ENABLE_DEBUG_MESSAGES)
+  /* Every thread needs an entry of its own in the ROB and LSQ, and
+   * physical registers for all of its architectural state plus one to
+   * rename into, or the threads can starve each other of registers
+   */
+  int threads = cpu->config.smt_threads;
+  if (threads > 1 && (fast_forward || cpu->config.rob_entries < threads ||
+                      cpu->config.lsq_entries < threads ||
+                      cpu->config.prf_regs <= RAT_Entries * threads))
   {
+    fprintf(stderr, "APEX_Error : %d threads need Simulate, rob_entries and lsq_entries of "
+                    "at least %d and prf_regs of at least %d\n",
+            threads, threads, RAT_Entries * threads + 1);
+    free(cpu);
+    return NULL;
+  }
+  cpu->rob_bits = 31 - __builtin_clz(cpu->config.rob_entries / threads);
+  cpu->lsq_bits = 31 - __builtin_clz(cpu->config.lsq_entries / threads);
 
-    if (strcmp(command, "Simulate") == 0)
+  /* Initialize PC, Registers and all pipeline stages. Every thread starts
+   * at the first instruction.
+   */
+  for (int t = 0; t < threads; ++t)
+  {
+    cpu->thread[t].pc = 4000;
+  }
+  cpu->clock = 1;
+  cpu->start_clock = 1;
+  cpu->max_cycles = no_of_cycles;
+  memset(cpu->regs_valid, 1, sizeof(int) * 32);
+  memset(cpu->stage, 0, sizeof(cpu->stage));
+  for (int i = 0; i < MAX_STAGES; ++i)
+  {
+    cpu->slot[i] = i;
+  }
+  fu_layout(cpu);
+  if (APEX_cache_init(cpu) != 0)
+  {
+    free(cpu);
+    return NULL;
+  }
+  APEX_memory_init(&cpu->memory, cpu->config.memory_words);
+
+  /* Every physical register starts out holding a valid zero. R0-R15 and
+   * the zero flag of thread t are mapped to the t-th block of RAT_Entries
+   * of them, and core_reg of every thread holds the thread number.
+   */
+  cpu->prf_ready = low_mask(cpu->config.prf_regs);
+  cpu->prf_free = low_mask(cpu->config.prf_regs) & ~low_mask(RAT_Entries * threads);
+  for (int t = 0; t < threads; ++t)
+  {
+    APEX_Thread *th = &cpu->thread[t];
+    for (int i = 0; i < RAT_Entries; ++i)
     {
+      th->rat[i] = t * RAT_Entries + i;
     }
+    cpu->prf_rd_hold |= low_mask(ARF) << (t * RAT_Entries);
+    cpu->prf_z_hold |= BIT(th->rat[Z_FLAG_REG]);
+    th->regs[cpu->config.core_reg] = t;
+    cpu->prf[th->rat[cpu->config.core_reg]] = t;
   }
 
-  /* Initialize PC, Registers and all pipeline stages */
-  cpu->pc = 4000;
-  cpu->clock = 1;
-  memset(cpu->regs, 0, sizeof(int) * 32);
-  memset(cpu->regs_valid, 1, sizeof(int) * 32);
-  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-  memset(cpu->data_memory, 0, sizeof(int) * 4000);
+  APEX_predictor_init(cpu);
 
-  /* Parse input file and create code memory */
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+  /* All latches start out empty; Fetch fills the fetch buffer instead */
+  for (int i = 0; i < cpu->num_stages; ++i)
+  {
+    cpu->stage[i].busy = 1;
+  }
+  return cpu;
+}
 
-  if (!cpu->code_memory)
+/* Prints the code memory the CPU was given and fast-forwards it when
+ * asked to
+ */
+static void
+cpu_start(APEX_CPU *cpu, const char *command)
+{
+  /* A trace carries code memory for apex_trace to print instead */
+  if (cpu->config.verbose && !cpu->config.trace[0])
+  {
+    APEX_print_code_memory(cpu->code_memory, cpu->code_memory_size);
+  }
+
+  if (strcmp(command, "Fastforward") == 0)
+  {
+    cpu->fast_forwarded = APEX_cpu_fast_forward(
+        cpu, cpu->config.ff_insns ? cpu->config.ff_insns : LLONG_MAX,
+        cpu->config.ff_pc ? cpu->config.ff_pc : -1);
+  }
+}
+
+/*
+ * This function creates and initializes APEX cpu.
+ *
+ * Note : You are free to edit this function according to your
+ * 				implementation
+ */
+APEX_CPU *
+APEX_cpu_init(const char *filename, const char *command, int no_of_cycles,
+              const APEX_Config *config)
+{
+  if (!filename && !command && !no_of_cycles)
   {
-    free(cpu);
     return NULL;
   }
 
-  if (ENABLE_DEBUG_MESSAGES)
+  APEX_CPU *cpu = cpu_create(command, no_of_cycles, config);
+  if (!cpu)
   {
-    fprintf(stderr,
-            "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
-            cpu->code_memory_size);
-    fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
-    printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "rs3", "imm");
+    return NULL;
+  }
 
-    for (int i = 0; i < cpu->code_memory_size; ++i)
-    {
-      printf("%-9s %-9d %-9d %-9d %-9d %-9d\n",
-             cpu->code_memory[i].opcode,
-             cpu->code_memory[i].rd,
-             cpu->code_memory[i].rs1,
-             cpu->code_memory[i].rs2,
-             cpu->code_memory[i].rs3,
-             cpu->code_memory[i].imm);
-    }
+  /* Map a pre-assembled program as code memory, or parse the input
+   * file into it
+   */
+  if (APEX_program_is_binary(filename))
+  {
+    cpu->code_memory = APEX_program_map(filename, &cpu->code_memory_size,
+                                        &cpu->code_mapped);
+  }
+  else
+  {
+    cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size, NULL);
   }
 
-  /* Make all stages busy except Fetch stage, initally to start the pipeline */
-  for (int i = 1; i < NUM_STAGES; ++i)
+  if (!cpu->code_memory)
   {
-    cpu->stage[i].busy = 1;
+    free(cpu);
+    return NULL;
   }
 
+  cpu_start(cpu, command);
+  return cpu;
+}
+
+/*
+ * Like APEX_cpu_init, for a program that is already decoded. The CPU
+ * borrows code_memory, which the caller keeps alive until APEX_cpu_stop
+ * and may share between CPUs, since simulation never writes to it.
+ */
+APEX_CPU *
+APEX_cpu_init_code(APEX_Instruction *code_memory, int size, const char *command,
+                   int no_of_cycles, const APEX_Config *config)
+{
+  APEX_CPU *cpu = cpu_create(command, no_of_cycles, config);
+  if (!cpu)
+  {
+    return NULL;
+  }
+  cpu->code_memory = code_memory;
+  cpu->code_memory_size = size;
+  cpu->code_borrowed = 1;
+  cpu_start(cpu, command);
   return cpu;
 }
 
@@ -98,10 +255,50 @@ APEX_cpu_init(const char *filename, const char *command, int no_of_cycles)
  */
 void APEX_cpu_stop(APEX_CPU *cpu)
 {
-  free(cpu->code_memory);
+  if (cpu->code_borrowed)
+  {
+    /* The caller frees it */
+  }
+  else if (cpu->code_mapped)
+  {
+    APEX_program_unmap(cpu->code_memory, cpu->code_mapped);
+  }
+  else
+  {
+    free(cpu->code_memory);
+  }
+  APEX_memory_free(&cpu->memory);
   free(cpu);
 }
 
+/*
+ * Starts a new measurement region at the current cycle, leaving the
+ * microarchitectural state alone
+ */
+void APEX_cpu_reset_stats(APEX_CPU *cpu)
+{
+  cpu->start_clock = cpu->clock;
+  cpu->ins_completed = 0;
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    cpu->thread[t].ins_completed = 0;
+  }
+  cpu->skipped_cycles = 0;
+  memset(cpu->stalls, 0, sizeof(cpu->stalls));
+  memset(&cpu->stats, 0, sizeof(cpu->stats));
+  cpu->memory.out_of_range = 0;
+  APEX_cache_reset_stats(cpu);
+  cpu->bp.branches = 0;
+  cpu->bp.mispredicts = 0;
+  cpu->bp.btb_lookups = 0;
+  cpu->bp.btb_hits = 0;
+  cpu->bp.penalty_cycles = 0;
+  cpu->bp.squashed = 0;
+  cpu->uop.lookups = 0;
+  cpu->uop.hits = 0;
+  cpu->uop.streamed = 0;
+}
+
 /* Converts the PC(4000 series) into
  * array index for code memory
  *
@@ -113,77 +310,786 @@ int get_code_index(int pc)
   return (pc - 4000) / 4;
 }
 
+/* Returns the latch currently holding pipeline stage s */
+static inline CPU_Stage *
+stage_latch(APEX_CPU *cpu, int s)
+{
+  return &cpu->stage[cpu->slot[s]];
+}
+
+/* Moves the contents of stage 'from' into stage 'to' by swapping their
+ * latches. 'to' has already been processed this cycle, so its old latch
+ * is handed back to 'from' as an empty bubble.
+ */
+static inline void
+advance_stage(APEX_CPU *cpu, int from, int to)
+{
+  uint8_t tmp = cpu->slot[to];
+  cpu->slot[to] = cpu->slot[from];
+  cpu->slot[from] = tmp;
+  cpu->stage[tmp].busy = 1;
+  cpu->stage[tmp].opcode = OP_NOP;
+}
+
+/* Empties the latch of stage s once its instruction has left it */
+static inline void
+clear_stage(APEX_CPU *cpu, int s)
+{
+  CPU_Stage *stage = stage_latch(cpu, s);
+  stage->busy = 1;
+  stage->stalled = 0;
+  stage->opcode = OP_NOP;
+}
+
+/* Architectural source registers of an instruction, -1 when unused */
 static void
-print_instruction(CPU_Stage *stage)
+instruction_sources(const APEX_Instruction *ins, int src[3])
 {
+  src[0] = src[1] = src[2] = -1;
+  switch (ins->format)
+  {
+  case FMT_RS1_RS2_RS3:
+    src[2] = ins->rs3;
+    /* fall through */
+  case FMT_RD_RS1_RS2:
+  case FMT_RS1_RS2_IMM:
+    src[1] = ins->rs2;
+    /* fall through */
+  case FMT_RD_RS1_IMM:
+  case FMT_RS1_IMM:
+    src[0] = ins->rs1;
+    break;
+
+  case FMT_IMM:
+    src[0] = Z_FLAG_REG;
+    break;
+
+  case FMT_NONE:
+  case FMT_RD_IMM:
+  case NUM_FORMATS:
+    break;
+  }
+}
 
-  if (strcmp(stage->opcode, "STORE") == 0)
+/* Publishes value on every tag in tags: marks them ready in the
+ * scoreboard and wakes up only the IQ entries waiting on them
+ */
+static void
+broadcast(APEX_CPU *cpu, uint64_t tags, int value)
+{
+  cpu->prf_ready |= tags;
+  for (; tags; tags &= tags - 1)
   {
-    //Implement logic if it's at fetch stage just don't rename the instruction
-    if (F)
+    int tag = ctz(tags);
+    uint64_t woken = cpu->iq_consumers[tag];
+    cpu->prf[tag] = value;
+    cpu->iq_consumers[tag] = 0;
+    for (; woken; woken &= woken - 1)
     {
-      printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
+      int i = ctz(woken);
+      IQ_Entry *entry = &cpu->iq[i];
+      if (entry->p1 == tag)
+        entry->rs1_value = value;
+      if (entry->p2 == tag)
+        entry->rs2_value = value;
+      if (entry->p3 == tag)
+        entry->rs3_value = value;
+      entry->wait &= ~BIT(tag);
+      if (!entry->wait)
+      {
+        cpu->iq_ready |= BIT(i);
+      }
     }
-    else
+  }
+}
+
+/* rob_entries is a power of two, config.c checks, and every thread
+ * gets the largest power of two of entries that fits its share
+ */
+#define ROB_MASK(cpu) (((unsigned int)1 << (cpu)->rob_bits) - 1)
+
+/* Thread owning ROB index, and the index of position pos of thread t */
+#define ROB_THREAD(cpu, index) ((index) >> (cpu)->rob_bits)
+#define ROB_INDEX(cpu, t, pos) ((t) << (cpu)->rob_bits | ((pos) & ROB_MASK(cpu)))
+
+static inline int
+rob_full(APEX_CPU *cpu, const APEX_Thread *th)
+{
+  return th->rob_tail - th->rob_head == ROB_MASK(cpu) + 1;
+}
+
+/* Appends the instruction of thread t held in stage to its ROB tail,
+ * returns its index
+ */
+static int
+rob_push(APEX_CPU *cpu, int t, CPU_Stage *stage, const APEX_Instruction *ins)
+{
+  APEX_Thread *th = &cpu->thread[t];
+  int index = ROB_INDEX(cpu, t, th->rob_tail++);
+  ROB_Entry *entry = &cpu->rob[index];
+  entry->pc = stage->pc;
+  entry->opcode = stage->opcode;
+  entry->rd = (apex_opcode_info[stage->opcode].flags & OPF_WRITES_RD) ? ins->rd : SINK_REG;
+  entry->completed = stage->opcode == OP_HALT;
+  entry->rd_release = 0;
+  entry->z_release = 0;
+  entry->dispatched = cpu->clock;
+  stage->rob = index;
+  th->refilling = 0;
+  return index;
+}
+
+/* Position of ROB index in the program order of its thread, 0 being the
+ * oldest
+ */
+static inline unsigned int
+rob_age(APEX_CPU *cpu, int index)
+{
+  return (index - cpu->thread[ROB_THREAD(cpu, index)].rob_head) & ROB_MASK(cpu);
+}
+
+/* Finishes the instruction held in stage: broadcasts its result and
+ * marks its ROB entry ready to retire
+ */
+static void
+complete_instruction(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  ROB_Entry *entry = &cpu->rob[stage->rob];
+  if (stage->prd != NO_TAG)
+  {
+    broadcast(cpu, BIT(stage->prd), stage->buffer);
+  }
+  entry->result = stage->buffer;
+  entry->completed = 1;
+}
+
+/* lsq_entries is a power of two, config.c checks, split like the ROB */
+#define LSQ_MASK(cpu) (((unsigned int)1 << (cpu)->lsq_bits) - 1)
+#define LSQ_INDEX(cpu, t, pos) ((t) << (cpu)->lsq_bits | ((pos) & LSQ_MASK(cpu)))
+
+static inline int
+lsq_full(APEX_CPU *cpu, const APEX_Thread *th)
+{
+  return th->lsq_tail - th->lsq_head == LSQ_MASK(cpu) + 1;
+}
+
+static inline int
+is_store(int opcode)
+{
+  return opcode == OP_STORE || opcode == OP_STR;
+}
+
+/* Appends the memory operation of thread t held in stage to its LSQ tail */
+static void
+lsq_push(APEX_CPU *cpu, int t, CPU_Stage *stage)
+{
+  int index = LSQ_INDEX(cpu, t, cpu->thread[t].lsq_tail++);
+  LSQ_Entry *entry = &cpu->lsq[index];
+  memset(entry, 0, sizeof(*entry));
+  entry->pc = stage->pc;
+  entry->opcode = stage->opcode;
+  entry->rob = stage->rob;
+  entry->prd = stage->prd;
+  stage->lsq = index;
+}
+
+/* Records the address computed by an integer unit. A store is then
+ * complete as far as the ROB is concerned, and any younger load that
+ * already read the same address from an older source has to replay.
+ */
+static void
+lsq_set_address(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  int t = ROB_THREAD(cpu, stage->rob);
+  APEX_Thread *th = &cpu->thread[t];
+  LSQ_Entry *entry = &cpu->lsq[stage->lsq];
+  entry->mem_address = stage->buffer;
+  entry->data = stage->rs1_value;
+  entry->mem_address_valid = 1;
+
+  if (!is_store(entry->opcode))
+  {
+    return;
+  }
+  complete_instruction(cpu, stage);
+
+  unsigned int pos = th->lsq_head + ((stage->lsq - th->lsq_head) & LSQ_MASK(cpu));
+  for (unsigned int p = pos + 1; p != th->lsq_tail; ++p)
+  {
+    LSQ_Entry *load = &cpu->lsq[LSQ_INDEX(cpu, t, p)];
+    if (load->executed && load->mem_address == entry->mem_address &&
+        (!load->forwarded || (int)(load->source - pos) < 0))
+    {
+      load->executed = 0;
+    }
+  }
+}
+
+/* Word at address of the data memory, shared with the other cores in
+ * Multicore
+ */
+static inline int
+data_read(APEX_CPU *cpu, int address)
+{
+  return cpu->shared ? APEX_memory_read_shared(&cpu->shared->memory, address)
+                     : APEX_memory_read(&cpu->memory, address);
+}
+
+static inline void
+data_write(APEX_CPU *cpu, int address, int value)
+{
+  if (cpu->shared)
+  {
+    APEX_memory_write_shared(&cpu->shared->memory, address, value);
+  }
+  else
+  {
+    APEX_memory_write(&cpu->memory, address, value);
+  }
+}
+
+/* LSQ position of the youngest store older than the load at pos of
+ * thread t with a known matching address, or pos if there is none. Loads
+ * only see the stores of their own thread before those retire.
+ */
+static unsigned int
+lsq_forward_source(APEX_CPU *cpu, int t, unsigned int pos)
+{
+  LSQ_Entry *load = &cpu->lsq[LSQ_INDEX(cpu, t, pos)];
+  for (unsigned int p = pos; p-- != cpu->thread[t].lsq_head;)
+  {
+    LSQ_Entry *store = &cpu->lsq[LSQ_INDEX(cpu, t, p)];
+    if (is_store(store->opcode) && store->mem_address_valid &&
+        store->mem_address == load->mem_address)
+    {
+      return p;
+    }
+  }
+  return pos;
+}
+
+/* Reads the value for the load at LSQ position pos of thread t. The
+ * youngest older store with a known matching address supplies it at
+ * once; older stores whose address is still unknown are bypassed and
+ * checked when they resolve. Otherwise it goes to the caches, and
+ * returns -1 without executing if they cannot take another miss.
+ */
+static int
+lsq_execute_load(APEX_CPU *cpu, int t, unsigned int pos)
+{
+  LSQ_Entry *load = &cpu->lsq[LSQ_INDEX(cpu, t, pos)];
+  unsigned int source = lsq_forward_source(cpu, t, pos);
+  if (source != pos)
+  {
+    load->data = cpu->lsq[LSQ_INDEX(cpu, t, source)].data;
+    load->forwarded = 1;
+    load->source = source;
+    load->ready = cpu->clock;
+  }
+  else
+  {
+    int ready = APEX_cache_load(cpu, load->mem_address);
+    if (ready < 0)
+    {
+      return -1;
+    }
+    /* Loads down a mispredicted path may compute any address */
+    load->data = data_read(cpu, load->mem_address);
+    load->forwarded = 0;
+    load->ready = ready;
+  }
+  load->executed = 1;
+  return 0;
+}
+
+/* LSQ position of the oldest load of thread t with a known address that
+ * has not read its value yet, or its lsq_tail if there is none
+ */
+static unsigned int
+lsq_port_load(APEX_CPU *cpu, int t)
+{
+  const APEX_Thread *th = &cpu->thread[t];
+  unsigned int pos = th->lsq_head;
+  for (; pos != th->lsq_tail; ++pos)
+  {
+    LSQ_Entry *entry = &cpu->lsq[LSQ_INDEX(cpu, t, pos)];
+    if (!is_store(entry->opcode) && entry->mem_address_valid && !entry->executed)
     {
-      printf("%s,R%d,R%d,#%d -> [%s,P%d,P%d,#%d] ",
-             stage->opcode, stage->rs1, stage->rs2, stage->imm,
-             stage->opcode, stage->p1, stage->p2, stage->imm);
+      break;
     }
   }
+  return pos;
+}
+
+/* The resource the instruction of thread t held in DRD is missing to
+ * leave decode, or STALL_NONE
+ */
+static int
+dispatch_stall(APEX_CPU *cpu, int t, const CPU_Stage *stage)
+{
+  const APEX_Opcode_Info *info = &apex_opcode_info[stage->opcode];
+  if (rob_full(cpu, &cpu->thread[t]))
+  {
+    return STALL_ROB;
+  }
+  if (stage->opcode == OP_HALT)
+  {
+    return STALL_NONE;
+  }
+  if (!(~cpu->iq_valid & low_mask(cpu->config.iq_entries)))
+  {
+    return STALL_IQ;
+  }
+  if (info->fu == FU_MEM && lsq_full(cpu, &cpu->thread[t]))
+  {
+    return STALL_LSQ;
+  }
+  if ((info->flags & OPF_WRITES_RD) && !cpu->prf_free)
+  {
+    return STALL_PRF;
+  }
+  if (info->fu == FU_BR && !(~cpu->bis_valid & low_mask(cpu->config.bis_entries)))
+  {
+    return STALL_BIS;
+  }
+  return STALL_NONE;
+}
+
+/* Records in mask of checkpoint k that thread t took the IQ entries or
+ * physical registers in bits. The checkpoints of other threads drop
+ * them instead: they may have held them before, and must not squash or
+ * free them once they are reused.
+ */
+static inline void
+bis_claim(APEX_CPU *cpu, int t, int k, uint64_t *mask, uint64_t bits)
+{
+  if (cpu->bis_thread[t] & BIT(k))
+  {
+    *mask |= bits;
+  }
+  else
+  {
+    *mask &= ~bits;
+  }
+}
+
+/* Renames the instruction of thread t held in stage. Sources read the
+ * thread's RAT, and a destination takes the lowest free physical
+ * register. The mappings it replaces are recorded in its ROB entry, to
+ * be released at commit.
+ */
+static void
+rename_instruction(APEX_CPU *cpu, int t, CPU_Stage *stage, const APEX_Instruction *ins,
+                   ROB_Entry *rob)
+{
+  uint8_t *rat = cpu->thread[t].rat;
+  int flags = apex_opcode_info[stage->opcode].flags;
+  int src[3];
+
+  instruction_sources(ins, src);
+  stage->p1 = src[0] < 0 ? NO_TAG : rat[src[0]];
+  stage->p2 = src[1] < 0 ? NO_TAG : rat[src[1]];
+  stage->p3 = src[2] < 0 ? NO_TAG : rat[src[2]];
+  stage->prd = NO_TAG;
+  rob->rd_release = 0;
+  rob->z_release = 0;
+
+  if (flags & OPF_WRITES_RD)
+  {
+    int prd = ctz(cpu->prf_free);
+    uint64_t bit = BIT(prd);
+
+    cpu->prf_free &= ~bit;
+    cpu->prf_ready &= ~bit;
+    cpu->prf_rd_hold |= bit;
+    rob->rd_release = BIT(rat[ins->rd]);
+    rat[ins->rd] = prd;
+    if (flags & OPF_SETS_Z)
+    {
+      cpu->prf_z_hold |= bit;
+      rob->z_release = BIT(rat[Z_FLAG_REG]);
+      rat[Z_FLAG_REG] = prd;
+    }
+    for (uint64_t m = cpu->bis_valid; m; m &= m - 1)
+    {
+      bis_claim(cpu, t, ctz(m), &cpu->bis[ctz(m)].alloc, bit);
+    }
+    stage->prd = prd;
+  }
+}
+
+/* Captures one source operand for a newly dispatched IQ entry */
+static void
+iq_capture_source(APEX_CPU *cpu, int i, uint8_t tag, int *value)
+{
+  if (tag == NO_TAG)
+  {
+    return;
+  }
+  if (cpu->prf_ready & BIT(tag))
+  {
+    *value = cpu->prf[tag];
+  }
+  else
+  {
+    cpu->iq[i].wait |= BIT(tag);
+    cpu->iq_consumers[tag] |= BIT(i);
+  }
+}
+
+/* Inserts the renamed instruction of thread t held in stage into a free
+ * IQ entry
+ */
+static void
+iq_dispatch(APEX_CPU *cpu, int t, CPU_Stage *stage)
+{
+  int i = ctz(~cpu->iq_valid & low_mask(cpu->config.iq_entries));
+  IQ_Entry *entry = &cpu->iq[i];
+  entry->pc = stage->pc;
+  entry->imm = stage->imm;
+  entry->opcode = stage->opcode;
+  entry->prd = stage->prd;
+  entry->p1 = stage->p1;
+  entry->p2 = stage->p2;
+  entry->p3 = stage->p3;
+  entry->rob = stage->rob;
+  entry->lsq = stage->lsq;
+  entry->wait = 0;
+
+  iq_capture_source(cpu, i, entry->p1, &entry->rs1_value);
+  iq_capture_source(cpu, i, entry->p2, &entry->rs2_value);
+  iq_capture_source(cpu, i, entry->p3, &entry->rs3_value);
+
+  cpu->iq_age[i] = cpu->iq_valid;
+  cpu->iq_valid |= BIT(i);
+  cpu->iq_fu[apex_opcode_info[entry->opcode].fu] |= BIT(i);
+  if (!entry->wait)
+  {
+    cpu->iq_ready |= BIT(i);
+  }
+  for (uint64_t m = cpu->bis_valid; m; m &= m - 1)
+  {
+    bis_claim(cpu, t, ctz(m), &cpu->bis[ctz(m)].iq, BIT(i));
+  }
+}
 
-  else if (strcmp(stage->opcode, "MOVC") == 0)
+/* Frees the IQ entries in mask */
+static void
+iq_remove(APEX_CPU *cpu, uint64_t mask)
+{
+  cpu->iq_valid &= ~mask;
+  cpu->iq_ready &= ~mask;
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    cpu->iq_fu[fu] &= ~mask;
+  }
+  for (uint64_t m = cpu->iq_valid; m; m &= m - 1)
   {
+    cpu->iq_age[ctz(m)] &= ~mask;
+  }
+}
 
-    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
+/* Oldest IQ entry among candidates, or -1. Starting from any candidate,
+ * follow the age matrix to an older candidate until none is left.
+ */
+static int
+iq_select(APEX_CPU *cpu, uint64_t candidates)
+{
+  if (!candidates)
+  {
+    return -1;
   }
+  int i = ctz(candidates);
+  uint64_t older;
+  while ((older = cpu->iq_age[i] & candidates))
+  {
+    i = ctz(older);
+  }
+  return i;
+}
+
+/* Moves IQ entry i into the first latch of a functional unit */
+static void
+iq_issue(APEX_CPU *cpu, int i, int s)
+{
+  IQ_Entry *entry = &cpu->iq[i];
+  CPU_Stage *stage = stage_latch(cpu, s);
+
+  stage->pc = entry->pc;
+  stage->imm = entry->imm;
+  stage->rs1_value = entry->rs1_value;
+  stage->rs2_value = entry->rs2_value;
+  stage->rs3_value = entry->rs3_value;
+  stage->opcode = entry->opcode;
+  stage->prd = entry->prd;
+  stage->p1 = entry->p1;
+  stage->p2 = entry->p2;
+  stage->p3 = entry->p3;
+  stage->rob = entry->rob;
+  stage->lsq = entry->lsq;
+  stage->busy = 0;
+  stage->stalled = 0;
+
+  iq_remove(cpu, BIT(i));
+}
+
+/* Takes a checkpoint for the branch of thread t just renamed in stage,
+ * predicted at fetch with global history history
+ */
+static void
+bis_push(APEX_CPU *cpu, int t, CPU_Stage *stage, uint64_t history)
+{
+  int k = ctz(~cpu->bis_valid & low_mask(cpu->config.bis_entries));
+  BIS_Entry *entry = &cpu->bis[k];
+  memcpy(entry->rat, cpu->thread[t].rat, sizeof(entry->rat));
+  entry->rob = stage->rob;
+  entry->predicted_pc = stage->buffer;
+  entry->history = history;
+  entry->cycle = cpu->clock;
+  entry->lsq_tail = cpu->thread[t].lsq_tail;
+  entry->alloc = 0;
+  entry->iq = 0;
+  cpu->bis_valid |= BIT(k);
+  cpu->bis_thread[t] |= BIT(k);
+}
 
-  else if (strcmp(stage->opcode, "STR") == 0)
+/* Checkpoint of the branch at ROB index rob */
+static int
+bis_find(APEX_CPU *cpu, int rob)
+{
+  for (uint64_t m = cpu->bis_valid; m; m &= m - 1)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
+    if (cpu->bis[ctz(m)].rob == rob)
+    {
+      return ctz(m);
+    }
   }
+  return -1;
+}
 
-  else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "AND") == 0 ||
-           strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "MUL") == 0 ||
-           strcmp(stage->opcode, "LDR") == 0)
+/* Recovers from a mispredicted branch in one step: restores the RAT,
+ * returns everything allocated after the branch to the free list, and
+ * squashes younger work in the IQ, ROB, LSQ and pipeline latches. Only
+ * the branch's own thread is touched. Fetch restarts at pc.
+ */
+static void
+bis_recover(APEX_CPU *cpu, int k, int pc)
+{
+  BIS_Entry *entry = &cpu->bis[k];
+  int t = ROB_THREAD(cpu, entry->rob);
+  APEX_Thread *th = &cpu->thread[t];
+  unsigned int age = rob_age(cpu, entry->rob);
+  uint64_t squashed = entry->iq & cpu->iq_valid;
+
+  cpu->bp.mispredicts++;
+  cpu->bp.penalty_cycles += cpu->clock - entry->cycle;
+  th->refilling = 1;
+  cpu->bp.squashed += ((th->rob_tail - th->rob_head) & ROB_MASK(cpu)) - age - 1 +
+                      th->fetch_tail - th->fetch_head;
+
+  memcpy(th->rat, entry->rat, sizeof(th->rat));
+  cpu->prf_free |= entry->alloc;
+  cpu->prf_rd_hold &= ~entry->alloc;
+  cpu->prf_z_hold &= ~entry->alloc;
+
+  iq_remove(cpu, squashed);
+  for (int tag = 0; tag < cpu->config.prf_regs; ++tag)
   {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+    cpu->iq_consumers[tag] &= ~squashed;
   }
+  th->rob_tail = th->rob_head + age + 1;
+  th->lsq_tail = entry->lsq_tail;
 
-  else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0 || strcmp(stage->opcode, "LOAD") == 0)
+  for (int s = NUM_STAGES; s < cpu->num_stages; ++s)
   {
+    CPU_Stage *stage = stage_latch(cpu, s);
+    if (!stage->busy && ROB_THREAD(cpu, stage->rob) == t && rob_age(cpu, stage->rob) > age)
+    {
+      clear_stage(cpu, s);
+    }
+  }
+  th->fetch_tail = th->fetch_head;
 
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+  for (uint64_t m = cpu->bis_thread[t]; m; m &= m - 1)
+  {
+    if (rob_age(cpu, cpu->bis[ctz(m)].rob) > age)
+    {
+      cpu->bis_valid &= ~BIT(ctz(m));
+    }
   }
+  cpu->bis_valid &= ~BIT(k);
+  cpu->bis_thread[t] &= cpu->bis_valid;
+
+  th->pc = pc;
+  th->fetch_blocked = 0;
+}
+
+/* FETCH_BUFFER_MAX is a power of two, so the ring indices wrap with it */
+#define FETCH_BUFFER_MASK (FETCH_BUFFER_MAX - 1)
 
-  if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0)
+/* Entries the fetch buffer of each thread holds at most */
+static inline unsigned int
+fetch_buffer_size(const APEX_CPU *cpu)
+{
+  return cpu->config.fetch_buffer ? cpu->config.fetch_buffer : cpu->config.fetch_width;
+}
+
+/* Returns 1 if th has room in its fetch buffer and code left to fetch */
+static inline int
+can_fetch(const APEX_CPU *cpu, const APEX_Thread *th)
+{
+  return !th->fetch_blocked && th->fetch_tail - th->fetch_head < fetch_buffer_size(cpu) &&
+         (unsigned)get_code_index(th->pc) < (unsigned)cpu->code_memory_size;
+}
+
+/* Adds n cycles in which stage width handled count instructions to its
+ * histogram
+ */
+static inline void
+count_width(APEX_CPU *cpu, int width, int count, int n)
+{
+  cpu->stats.width[width][count < WIDTH_BINS ? count : WIDTH_BINS - 1] += n;
+}
+
+/* Stage content is reported when printing every cycle or recording a
+ * trace
+ */
+static inline int
+tracing(const APEX_CPU *cpu)
+{
+  return cpu->config.verbose || cpu->trace;
+}
+
+/* Records event into the trace when one is open, else prints it */
+static void
+trace_event(APEX_CPU *cpu, const APEX_Trace_Record *record)
+{
+  if (cpu->trace)
   {
-    printf("%s,#%d", stage->opcode, stage->imm);
+    APEX_trace_record(cpu->trace, record);
   }
+  else
+  {
+    APEX_trace_print(record, cpu->code_memory, cpu->code_memory_size, &cpu->config);
+  }
+}
 
-  if (strcmp(stage->opcode, "JUMP") == 0)
+/* Debug function which dumps the cpu stage
+ * content
+ *
+ * Note : You are not supposed to edit this function
+ *
+ */
+static void
+print_stage_content(APEX_CPU *cpu, int event, int unit, int latch, const CPU_Stage *stage)
+{
+  APEX_Trace_Record record = {
+      .clock = cpu->clock,
+      .pc = stage->pc,
+      .event = event,
+      .opcode = stage->opcode,
+      .unit = unit,
+      .latch = latch,
+      .prd = stage->prd,
+      .p1 = stage->p1,
+      .p2 = stage->p2,
+      .p3 = stage->p3,
+  };
+  trace_event(cpu, &record);
+}
+
+/* Looks the instruction at code index up in the uop cache, filling its
+ * entry on a miss. Returns 1 on a hit.
+ */
+static int
+uop_lookup(APEX_CPU *cpu, int index)
+{
+  int *tag = &cpu->uop.tag[index & (cpu->config.uop_cache - 1)];
+  cpu->uop.lookups++;
+  if (*tag == index + 1)
   {
-    printf("%s,R%d,#%d", stage->opcode, stage->rs1, stage->imm);
+    cpu->uop.hits++;
+    return 1;
   }
+  *tag = index + 1;
+  return 0;
+}
+
+/* Returns 1 if the instruction at pc is in the uop cache */
+static int
+uop_holds(const APEX_CPU *cpu, int pc)
+{
+  int index = get_code_index(pc);
+  return (unsigned)index < (unsigned)cpu->code_memory_size &&
+         cpu->uop.tag[index & (cpu->config.uop_cache - 1)] == index + 1;
+}
+
+static const char *const fetch_policy_names[NUM_FETCH_POLICIES] = {
+    [FETCH_ROUND_ROBIN] = "round_robin", [FETCH_ICOUNT] = "icount"};
+
+/*
+ * Returns the APEX_Fetch_Policy called name, or -1
+ */
+int APEX_fetch_policy(const char *name)
+{
+  for (int p = 0; p < NUM_FETCH_POLICIES; ++p)
+  {
+    if (strcmp(name, fetch_policy_names[p]) == 0)
+    {
+      return p;
+    }
+  }
+  return -1;
+}
+
+const char *APEX_fetch_policy_name(int policy)
+{
+  return fetch_policy_names[policy];
+}
 
-  if (strcmp(stage->opcode, "HALT") == 0 || strcmp(stage->opcode, "HALT\n") == 0)
+/* Instructions of thread t waiting in its fetch buffer or in the IQ */
+static int
+thread_icount(const APEX_CPU *cpu, int t)
+{
+  const APEX_Thread *th = &cpu->thread[t];
+  int count = th->fetch_tail - th->fetch_head;
+  for (uint64_t m = cpu->iq_valid; m; m &= m - 1)
   {
-    printf("%s", stage->opcode);
+    count += ROB_THREAD(cpu, cpu->iq[ctz(m)].rob) == t;
   }
+  return count;
 }
 
-/* Debug function which dumps the cpu stage
- * content
- *
- * Note : You are not supposed to edit this function
- *
+/* Thread fetch takes instructions from this cycle, or -1 if none can.
+ * Threads are tried in turn from the one after the last fetched, and
+ * ICOUNT takes the first with the fewest instructions not yet issued.
  */
-static void
-print_stage_content(char *name, CPU_Stage *stage)
+static int
+fetch_select(APEX_CPU *cpu)
 {
-  printf("%-15s: pc(%d) ", name, stage->pc);
-  print_instruction(stage);
-  printf("\n");
+  int threads = cpu->config.smt_threads;
+  int best = -1;
+  int best_count = INT_MAX;
+
+  for (int n = 1; n <= threads; ++n)
+  {
+    int t = (cpu->fetch_thread + n) % threads;
+    if (!can_fetch(cpu, &cpu->thread[t]))
+    {
+      continue;
+    }
+    if (cpu->config.fetch_policy == FETCH_ROUND_ROBIN)
+    {
+      return t;
+    }
+    int count = thread_icount(cpu, t);
+    if (count < best_count)
+    {
+      best = t;
+      best_count = count;
+    }
+  }
+  return best;
 }
 
 /*
@@ -194,35 +1100,76 @@ print_stage_content(char *name, CPU_Stage *stage)
  */
 int fetch(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[F];
-  if (!stage->busy && !stage->stalled)
+  int fetched = 0;
+  int t = fetch_select(cpu);
+
+  if (t < 0)
+  {
+    count_width(cpu, WIDTH_FETCH, 0, 1);
+    return 0;
+  }
+  APEX_Thread *th = &cpu->thread[t];
+  cpu->fetch_thread = t;
+
+  /* Up to fetch_width instructions of one thread, as long as its fetch
+   * buffer has room for them
+   */
+  while (fetched < cpu->config.fetch_width && !th->fetch_blocked &&
+         th->fetch_tail - th->fetch_head < fetch_buffer_size(cpu))
   {
-    /* Store current PC in fetch latch */
-    stage->pc = cpu->pc;
+    int index = get_code_index(th->pc);
+    if (index < 0 || index >= cpu->code_memory_size)
+    {
+      break;
+    }
+
+    /* Store current PC in the fetch buffer entry */
+    th->fetch_history[th->fetch_tail & FETCH_BUFFER_MASK] = cpu->bp.history[t];
+    CPU_Stage *stage = &th->fetch_buffer[th->fetch_tail++ & FETCH_BUFFER_MASK];
+    stage->pc = th->pc;
 
     /* Index into code memory using this pc and copy all instruction fields into
      * fetch latch
      */
-    APEX_Instruction *current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
-    stage->rd = current_ins->rd;
-    stage->rs1 = current_ins->rs1;
-    stage->rs2 = current_ins->rs2;
-    stage->rs3 = current_ins->rs3;
+    APEX_Instruction *current_ins = &cpu->code_memory[index];
+    stage->opcode = current_ins->opcode;
     stage->imm = current_ins->imm;
-    stage->rd = current_ins->rd;
+    int cached = cpu->config.uop_cache && uop_lookup(cpu, index);
 
-    /* Update PC for next instruction */
-    cpu->pc += 4;
+    /* Update PC for next instruction. The latch keeps the prediction for
+     * branch_fu to check.
+     */
+    th->pc = APEX_predict(cpu, t, th->pc, stage->opcode);
+    stage->buffer = th->pc;
+    stage->busy = 0;
+    stage->stalled = 0;
+
+    /* Nothing is fetched past HALT */
+    if (stage->opcode == OP_HALT)
+    {
+      th->fetch_blocked = 1;
+    }
 
-    /* Copy data from fetch latch to decode latch*/
-    cpu->stage[DRD] = cpu->stage[F];
+    cpu->stats.occupancy[F]++;
+    if (tracing(cpu))
+    {
+      print_stage_content(cpu, TRACE_FETCH, 0, fetched, stage);
+    }
+    fetched++;
 
-    if (ENABLE_DEBUG_MESSAGES)
+    /* A predicted taken branch ends the fetch group, unless the uop cache
+     * holds both it and its target
+     */
+    if (th->pc != stage->pc + 4)
     {
-      print_stage_content("Fetch", stage);
+      if (!cached || !uop_holds(cpu, th->pc))
+      {
+        break;
+      }
+      cpu->uop.streamed++;
     }
   }
+  count_width(cpu, WIDTH_FETCH, fetched, 1);
   return 0;
 }
 
@@ -236,362 +1183,897 @@ int fetch(APEX_CPU *cpu)
  */
 int decode(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[DRD];
-  if (!stage->busy && !stage->stalled)
+  int threads = cpu->config.smt_threads;
+  int decoded = 0;
+
+  /* The threads take turns at going first. Each decodes in program order
+   * from the head of its fetch buffer, up to the first instruction that
+   * cannot dispatch, while decode_width allows.
+   */
+  for (int n = 0; n < threads; ++n)
   {
-    if (strcmp(stage->opcode, "STORE") == 0)
+    int t = (cpu->clock + n) % threads;
+    APEX_Thread *th = &cpu->thread[t];
+
+    cpu->stats.occupancy[DRD] += th->fetch_tail - th->fetch_head;
+    for (; decoded < cpu->config.decode_width && th->fetch_head != th->fetch_tail; ++decoded)
     {
+      CPU_Stage *stage = &th->fetch_buffer[th->fetch_head & FETCH_BUFFER_MASK];
+      APEX_Instruction *ins = &cpu->code_memory[get_code_index(stage->pc)];
+      int fu = apex_opcode_info[stage->opcode].fu;
+
+      int stall = stage->opcode == OP_NOP ? STALL_NONE : dispatch_stall(cpu, t, stage);
+
+      stage->stalled = stall != STALL_NONE;
+      cpu->stalls[stall] += stage->stalled;
+
+      switch (stage->opcode)
+      {
+      case OP_HALT:
+        /* Nothing to execute, HALT goes straight to the ROB as completed
+         * and stops its thread when it retires
+         */
+        if (!stage->stalled)
+        {
+          rob_push(cpu, t, stage, ins);
+        }
+        break;
+
+      case OP_NOP:
+        break;
+
+      default:
+        if (!stage->stalled)
+        {
+          rob_push(cpu, t, stage, ins);
+          rename_instruction(cpu, t, stage, ins, &cpu->rob[stage->rob]);
+          if (fu == FU_MEM)
+          {
+            lsq_push(cpu, t, stage);
+          }
+          iq_dispatch(cpu, t, stage);
+          if (fu == FU_BR)
+          {
+            bis_push(cpu, t, stage,
+                     th->fetch_history[th->fetch_head & FETCH_BUFFER_MASK]);
+          }
+        }
+        break;
+      }
+
+      if (tracing(cpu))
+      {
+        print_stage_content(cpu, stage->stalled ? TRACE_DECODE_STALLED : TRACE_DECODE, 0,
+                            decoded, stage);
+      }
+
+      if (stage->stalled)
+      {
+        break;
+      }
+      th->fetch_head++;
     }
+  }
+  count_width(cpu, WIDTH_DECODE, decoded, 1);
+  return 0;
+}
 
-    else if (strcmp(stage->opcode, "MOVC") == 0)
-    {
+/* Returns 1 if unit fu can take an instruction this cycle */
+static inline int
+fu_free(APEX_CPU *cpu, const APEX_FU *fu)
+{
+  int s = fu->first;
+  if (cpu->config.fu_pipelined[fu->fu])
+  {
+    return stage_latch(cpu, s)->busy;
+  }
+  while (s < fu->first + fu->latency && stage_latch(cpu, s)->busy)
+  {
+    ++s;
+  }
+  return s == fu->first + fu->latency;
+}
 
-      // printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
-    }
+/* IQ entries that issue to units of class fu */
+static inline uint64_t
+iq_class(APEX_CPU *cpu, int fu)
+{
+  return fu == FU_INT ? cpu->iq_fu[FU_INT] | cpu->iq_fu[FU_MEM] : cpu->iq_fu[fu];
+}
 
-    else if (strcmp(stage->opcode, "STR") == 0)
+/*
+ *  Issue logic between the IQ and the functional units
+ *
+ *  Up to issue_width of the oldest ready entries leave the IQ, each for
+ *  a free unit of its class. Memory operations share
+ *  the integer units for address generation and may leave the IQ in any
+ *  order, the LSQ keeps them ordered afterwards.
+ */
+int issue(APEX_CPU *cpu)
+{
+  uint64_t ready = cpu->iq_ready;
+  uint64_t open = 0; // Entries of the classes with a unit still free
+  int free_units[NUM_FU_CLASSES][FU_MAX_UNITS];
+  int count[NUM_FU_CLASSES] = {0};
+  int next[NUM_FU_CLASSES] = {0};
+  int issued = 0;
+  int i;
+
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    const APEX_FU *fu = &cpu->fu[u];
+    if (fu_free(cpu, fu))
     {
-      // printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
+      free_units[fu->fu][count[fu->fu]++] = u;
+      open |= iq_class(cpu, fu->fu);
     }
+  }
 
-    else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "AND") == 0 ||
-             strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "MUL") == 0 ||
-             strcmp(stage->opcode, "LDR") == 0)
+  for (; issued < cpu->config.issue_width && (i = iq_select(cpu, ready & open)) >= 0; ++issued)
+  {
+    int fu = apex_opcode_info[cpu->iq[i].opcode].fu;
+    if (fu == FU_MEM)
     {
-      // printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
+      fu = FU_INT;
     }
-
-    else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0 || strcmp(stage->opcode, "LOAD") == 0)
+    int u = free_units[fu][next[fu]++];
+    iq_issue(cpu, i, cpu->fu[u].first);
+    cpu->stats.fu_issued[u]++;
+    ready &= ~BIT(i);
+    if (next[fu] == count[fu])
     {
-
-      // printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
+      open &= ~iq_class(cpu, fu);
     }
+  }
+  count_width(cpu, WIDTH_ISSUE, issued, 1);
+
+  /* Whatever is still ready found every unit of its class taken, unless
+   * the issue width held it back
+   */
+  cpu->stats.fu_busy[FU_INT] += !!(ready & iq_class(cpu, FU_INT) & ~open);
+  cpu->stats.fu_busy[FU_MUL] += !!(ready & iq_class(cpu, FU_MUL) & ~open);
+  cpu->stats.fu_busy[FU_BR] += !!(ready & iq_class(cpu, FU_BR) & ~open);
+  return 0;
+}
 
-    if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0)
-    {
-      // printf("%s,#%d", stage->opcode, stage->imm);
-    }
+/* Reports latch s of a functional unit */
+static void
+print_fu_stage(APEX_CPU *cpu, const APEX_FU *fu, int s, CPU_Stage *stage)
+{
+  print_stage_content(cpu, TRACE_FU, TRACE_UNIT(fu->fu, fu->unit), s, stage);
+}
 
-    if (strcmp(stage->opcode, "JUMP") == 0)
-    {
-      // printf("%s,R%d,#%d", stage->opcode, stage->rs1, stage->imm);
-    }
+/*
+ *  Execute stage: clocks every functional unit. The instruction in the
+ *  last latch of a unit produces its result there, the others move one
+ *  latch on. Each unit is walked from its last latch back, so a latch is
+ *  always empty by the time the one behind it moves in.
+ */
+int execute(APEX_CPU *cpu)
+{
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    const APEX_FU *fu = &cpu->fu[u];
+    int last = fu->first + fu->latency - 1;
+    CPU_Stage *stage = stage_latch(cpu, last);
 
-    if (strcmp(stage->opcode, "HALT") == 0 || strcmp(stage->opcode, "HALT\n") == 0)
+    if (!stage->busy)
     {
-      // printf("%s", stage->opcode);
+      cpu->stats.fu_occupancy[u]++;
+      if (tracing(cpu))
+      {
+        print_fu_stage(cpu, fu, fu->latency - 1, stage);
+      }
+      switch (fu->fu)
+      {
+      case FU_INT:
+        integer_fu(cpu, stage);
+        break;
+
+      case FU_MUL:
+        multiplication_fu(cpu, stage);
+        break;
+
+      case FU_BR:
+        branch_fu(cpu, stage);
+        break;
+      }
+      clear_stage(cpu, last);
     }
-    /* Copy data from decode latch to execute latch*/
-    // cpu->stage[EX] = cpu->stage[DRD];
 
-    if (ENABLE_DEBUG_MESSAGES)
+    for (int s = last - 1; s >= fu->first; --s)
     {
-      print_stage_content("Decode/Rename", stage);
+      stage = stage_latch(cpu, s);
+      if (!stage->busy)
+      {
+        cpu->stats.fu_occupancy[u]++;
+        if (tracing(cpu))
+        {
+          print_fu_stage(cpu, fu, s - fu->first, stage);
+        }
+        advance_stage(cpu, s, s + 1);
+      }
     }
   }
   return 0;
 }
 
-int integer1_fu(APEX_CPU *cpu)
+/* Last stage of an integer unit: computes the result, or the address of
+ * a memory operation
+ */
+int integer_fu(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  CPU_Stage *stage = &cpu->stage[INT1_FU];
+  switch (stage->opcode)
+  {
+  case OP_MOVC:
+    stage->buffer = stage->imm + 0;
+    break;
 
-  if (!stage->busy && !stage->stalled)
-  { // This is just a Delay Latch
-    if (strcmp(stage->opcode, "MOVC") == 0 ||  strcmp(stage->opcode, "STORE") == 0 || strcmp(stage->opcode, "STR") == 0 ||
-       strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "LDR") == 0 ||  strcmp(stage->opcode, "LOAD") == 0 ||
-       strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 ||
-       strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0)
-    {
-    }
-    cpu->stage[INT2_FU] = cpu->stage[INT1_FU];
-    if (ENABLE_DEBUG_MESSAGES)
-    {
-      print_stage_content("INT1_FU_STAGE", stage);
-      // flushStage(cpu, INTFU1);
-    }
+  case OP_ADD:
+    stage->buffer = stage->rs1_value + stage->rs2_value;
+    break;
+
+  case OP_LDR:
+    stage->buffer = stage->rs1_value + stage->rs2_value;
+    break;
+
+  case OP_SUB:
+    stage->buffer = stage->rs1_value - stage->rs2_value;
+    break;
+
+  case OP_AND:
+    stage->buffer = stage->rs1_value & stage->rs2_value;
+    break;
+
+  case OP_OR:
+    stage->buffer = stage->rs1_value | stage->rs2_value;
+    break;
+
+  case OP_EXOR:
+    stage->buffer = stage->rs1_value ^ stage->rs2_value;
+    break;
+
+  case OP_ADDL:
+    stage->buffer = stage->rs1_value + stage->imm;
+    break;
 
+  case OP_SUBL:
+    stage->buffer = stage->rs1_value - stage->imm;
+    break;
+
+  case OP_STORE:
+    stage->buffer = stage->rs2_value + stage->imm;
+    break;
+
+  case OP_STR:
+    stage->buffer = stage->rs2_value + stage->rs3_value;
+    break;
+
+  case OP_LOAD:
+    stage->buffer = stage->rs1_value + stage->imm;
+    break;
+
+  default:
+    break;
+  }
+
+  /* Memory operations hand their address to the LSQ, everything else
+   * is done
+   */
+  if (apex_opcode_info[stage->opcode].fu == FU_MEM)
+  {
+    lsq_set_address(cpu, stage);
+  }
+  else
+  {
+    complete_instruction(cpu, stage);
+  }
+  return 0;
+}
+
+/* Last stage of a multiplier */
+int multiplication_fu(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  if (stage->opcode == OP_MUL)
+  {
+    stage->buffer = stage->rs1_value * stage->rs2_value;
   }
+  complete_instruction(cpu, stage);
   return 0;
 }
 
-int integer2_fu(APEX_CPU *cpu)
+/* Last stage of a branch unit: resolves the branch against its
+ * prediction
+ */
+int branch_fu(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  CPU_Stage *stage = &cpu->stage[INT2_FU];
+  int taken = 0;
+  int target = stage->pc + stage->imm;
 
-  if (!stage->busy && !stage->stalled)
+  /* BZ/BNZ read the zero flag as the last flag-setting result */
+  switch (stage->opcode)
   {
-    if (strcmp(stage->opcode, "MOVC") == 0)
-    {
-      stage->buffer = stage->imm + 0;
-    }
+  case OP_BZ:
+    taken = stage->rs1_value == 0;
+    break;
+
+  case OP_BNZ:
+    taken = stage->rs1_value != 0;
+    break;
+
+  case OP_JUMP:
+    taken = 1;
+    target = stage->rs1_value + stage->imm;
+    break;
+
+  default:
+    break;
+  }
+
+  complete_instruction(cpu, stage);
+
+  /* Fetch went on down the predicted path. If that was wrong, everything
+   * younger than the branch is squashed and fetch restarts at the
+   * actual next pc, otherwise the checkpoint is simply dropped.
+   */
+  int t = ROB_THREAD(cpu, stage->rob);
+  int k = bis_find(cpu, stage->rob);
+  if (k < 0)
+  {
+    fprintf(stderr, "APEX_Error : Internal error, no branch checkpoint for pc(%d) in cycle "
+                    "%d\n",
+            stage->pc, cpu->clock);
+    exit(1);
+  }
+  BIS_Entry *bis = &cpu->bis[k];
+  int next_pc = taken ? target : stage->pc + 4;
+
+  /* Training uses the history the branch was predicted with at fetch.
+   * After a misprediction the history goes back to that, plus the
+   * actual outcome of a conditional branch; younger branches fetched
+   * since then are squashed along with their history bits.
+   */
+  APEX_predictor_update(cpu, stage->pc, stage->opcode, bis->history, taken, target);
+  if (next_pc != bis->predicted_pc)
+  {
+    bis_recover(cpu, k, next_pc);
+    cpu->bp.history[t] = stage->opcode == OP_JUMP ? bis->history
+                                                  : bis->history << 1 | taken;
+  }
+  else
+  {
+    cpu->bis_valid &= ~BIT(k);
+    cpu->bis_thread[t] &= ~BIT(k);
+  }
+  return 0;
+}
 
-    else if (strcmp(stage->opcode, "ADD") == 0)
+/* Thread whose oldest load with a known address that has not read its
+ * value yet takes the single memory port this cycle, or -1 if no thread
+ * has one. The threads take turns at going first. Sets *port to the LSQ
+ * position of the load.
+ */
+static int
+port_thread(APEX_CPU *cpu, unsigned int *port)
+{
+  int threads = cpu->config.smt_threads;
+  for (int n = 0; n < threads; ++n)
+  {
+    int t = (cpu->clock + n) % threads;
+    if ((*port = lsq_port_load(cpu, t)) != cpu->thread[t].lsq_tail)
     {
-      stage->buffer = stage->rs1_value + stage->rs2_value;
+      return t;
     }
-    else if (strcmp(stage->opcode, "LDR") == 0)
+  }
+  return -1;
+}
+
+/*
+ *  Memory Stage of APEX Pipeline
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int memory(APEX_CPU *cpu)
+{
+  CPU_Stage *stage = stage_latch(cpu, MEM);
+
+  /* The oldest waiting load of one thread takes the single memory port
+   * this cycle, and holds it while the L1D has no MSHR left for its miss
+   */
+  unsigned int port;
+  int t = port_thread(cpu, &port);
+  if (t >= 0)
+  {
+    LSQ_Entry *entry = &cpu->lsq[LSQ_INDEX(cpu, t, port)];
+    if (lsq_execute_load(cpu, t, port) != 0)
     {
-      stage->buffer = stage->rs1_value + stage->rs2_value;
-      //  updtLSQ(cpu, INTFU2);
+      cpu->cache.mshr_stalls++;
     }
-    else if (strcmp(stage->opcode, "SUB") == 0)
+    else
     {
-      stage->buffer = stage->rs1_value - stage->rs2_value;
+      stage->pc = entry->pc;
+      stage->opcode = entry->opcode;
+      stage->buffer = entry->data;
+      stage->busy = 0;
+      cpu->stats.occupancy[MEM]++;
+      if (tracing(cpu))
+      {
+        print_stage_content(cpu, TRACE_MEMORY, 0, 0, stage);
+      }
+      clear_stage(cpu, MEM);
     }
+  }
 
-    else if (strcmp(stage->opcode, "AND") == 0)
+  /* A load's value is final once it has arrived and every older store
+   * address of its thread is known. Stores write data memory only when
+   * they retire.
+   */
+  for (t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    const APEX_Thread *th = &cpu->thread[t];
+    int unresolved_store = 0;
+    for (unsigned int pos = th->lsq_head; pos != th->lsq_tail; ++pos)
     {
-      stage->buffer = stage->rs1_value & stage->rs2_value;
+      LSQ_Entry *entry = &cpu->lsq[LSQ_INDEX(cpu, t, pos)];
+      if (is_store(entry->opcode))
+      {
+        unresolved_store |= !entry->mem_address_valid;
+      }
+      else if (entry->executed && !entry->completed && !unresolved_store &&
+               entry->ready <= cpu->clock)
+      {
+        stage->opcode = entry->opcode;
+        stage->prd = entry->prd;
+        stage->rob = entry->rob;
+        stage->buffer = entry->data;
+        complete_instruction(cpu, stage);
+        clear_stage(cpu, MEM);
+        entry->completed = 1;
+      }
     }
+  }
+  return 0;
+}
 
-    else if (strcmp(stage->opcode, "OR") == 0)
-    {
-      stage->buffer = stage->rs1_value | stage->rs2_value;
-    }
+/*
+ *  Commit Stage of APEX Pipeline
+ *
+ *  Retires up to commit_width completed instructions from the ROB heads
+ *  into the architectural register files, the threads taking turns at
+ *  going first. A thread stops after HALT.
+ */
+int commit(APEX_CPU *cpu)
+{
+  int threads = cpu->config.smt_threads;
+  int n = 0;
 
-    else if (strcmp(stage->opcode, "EX-OR") == 0)
-    {
-      stage->buffer = stage->rs1_value ^ stage->rs2_value;
-    }
+  cpu->halted = 1;
+  for (int k = 0; k < threads; ++k)
+  {
+    int t = (cpu->clock + k) % threads;
+    APEX_Thread *th = &cpu->thread[t];
 
-    else if (strcmp(stage->opcode, "ADDL") == 0)
+    for (; n < cpu->config.commit_width && !th->halted && th->rob_head != th->rob_tail; ++n)
     {
-      stage->buffer = stage->rs1_value + stage->imm;
+      ROB_Entry *entry = &cpu->rob[ROB_INDEX(cpu, t, th->rob_head)];
+      if (!entry->completed)
+      {
+        break;
+      }
+      if (apex_opcode_info[entry->opcode].fu == FU_MEM)
+      {
+        LSQ_Entry *mem = &cpu->lsq[LSQ_INDEX(cpu, t, th->lsq_head++)];
+        if (is_store(mem->opcode))
+        {
+          data_write(cpu, mem->mem_address, mem->data);
+          APEX_cache_store(cpu, mem->mem_address);
+        }
+        cpu->memory.out_of_range +=
+            (unsigned int)mem->mem_address >= (unsigned int)cpu->memory.size;
+      }
+      th->regs[entry->rd] = entry->result;
+
+      /* A physical register is free once neither R0-R15 nor the zero flag
+       * of any thread maps to it any more
+       */
+      cpu->prf_rd_hold &= ~entry->rd_release;
+      cpu->prf_z_hold &= ~entry->z_release;
+      cpu->prf_free |= (entry->rd_release | entry->z_release) &
+                       ~(cpu->prf_rd_hold | cpu->prf_z_hold);
+      th->halted = entry->opcode == OP_HALT;
+      th->ins_completed++;
+      cpu->ins_completed++;
+      cpu->stats.opcode_count[entry->opcode]++;
+      cpu->stats.opcode_latency[entry->opcode] += (uint16_t)(cpu->clock - entry->dispatched);
+      th->rob_head++;
     }
+    cpu->halted &= th->halted;
+  }
+  return 0;
+}
 
-    else if (strcmp(stage->opcode, "SUBL") == 0)
-    {
-      stage->buffer = stage->rs1_value - stage->imm;
-    }
+/* Cycles until memory() can next make progress on thread t, INT_MAX if never */
+static int
+lsq_wait(APEX_CPU *cpu, int t)
+{
+  const APEX_Thread *th = &cpu->thread[t];
+  int unresolved_store = 0;
+  int n = INT_MAX;
 
-    else if (strcmp(stage->opcode, "STORE") == 0)
+  unsigned int port = lsq_port_load(cpu, t);
+  if (port != th->lsq_tail)
+  {
+    if (lsq_forward_source(cpu, t, port) != port ||
+        (n = APEX_cache_wait(cpu, cpu->lsq[LSQ_INDEX(cpu, t, port)].mem_address)) == 0)
     {
-      stage->buffer = stage->rs2_value + stage->imm;
-
-      // updtLSQ(cpu, INTFU2);
+      return 0;
     }
-    
-    else if(strcmp(stage->opcode, "STR") == 0){
-      stage->buffer = stage->rs2_value + stage->rs3_value;
-    }
-
-    else if (strcmp(stage->opcode, "LOAD") == 0)
+  }
+  for (unsigned int pos = th->lsq_head; pos != th->lsq_tail; ++pos)
+  {
+    LSQ_Entry *entry = &cpu->lsq[LSQ_INDEX(cpu, t, pos)];
+    if (is_store(entry->opcode))
     {
-      stage->buffer = stage->rs1_value + stage->imm;
-      // updtLSQ(cpu, INTFU2);
+      unresolved_store |= !entry->mem_address_valid;
     }
-
-    if (ENABLE_DEBUG_MESSAGES)
+    else if (entry->executed && !entry->completed && !unresolved_store)
     {
-      print_stage_content("INT2_FU_STAGE",stage);
+      if (entry->ready <= cpu->clock)
+      {
+        return 0;
+      }
+      n = entry->ready - cpu->clock < n ? entry->ready - cpu->clock : n;
     }
-
-    // if (strcmp(stage->opcode, "") != FREE && (strcmp(stage->opcode, "LOAD") != FREE) && stage->prd != COMMIT)
-    // {
-    //   pushResults(cpu, INTFU2);
-    // }
-    // if (strcmp(stage->opcode, "") != FREE && stage->lsq_i == COMMIT)
-    // {
-    //   updtROB(cpu, INTFU2);
-    // }
-
-    // flushStage(cpu, INTFU2);
   }
-
-  return 0;
+  return n;
 }
 
-int multiplication1_fu(APEX_CPU *cpu)
+/*
+ * Number of cycles, starting with the current one, in which no stage can
+ * do anything except move instructions down the functional units.
+ * Any state change other than that, and any event that could follow from
+ * it, needs a last FU latch, ready IQ entry, retirable ROB head, memory
+ * operation or fetch that the checks below rule out. The state is then
+ * frozen until the instruction nearest the end of its unit reaches the
+ * last latch, or the caches return a load or free an MSHR.
+ */
+static int
+idle_cycles(APEX_CPU *cpu)
 {
-  
-  CPU_Stage *stage = &cpu->stage[MUL1_FU];
-  if (!stage->busy && !stage->stalled)
+  int n = INT_MAX;
+
+  if (!stage_latch(cpu, MEM)->busy || cpu->iq_ready)
+  {
+    return 0;
+  }
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
   {
-    if (strcmp(stage->opcode, "MUL") == 0)
+    APEX_Thread *th = &cpu->thread[t];
+    ROB_Entry *head = &cpu->rob[ROB_INDEX(cpu, t, th->rob_head)];
+    CPU_Stage *next = &th->fetch_buffer[th->fetch_head & FETCH_BUFFER_MASK];
+    int wait;
+
+    if (th->rob_head != th->rob_tail && head->completed)
+    {
+      return 0;
+    }
+    if (th->fetch_head != th->fetch_tail &&
+        (next->opcode == OP_NOP || dispatch_stall(cpu, t, next) == STALL_NONE))
     {
-      // stage->stalled = NONSTALLED;
+      return 0;
     }
-    cpu->stage[MUL2_FU] = cpu->stage[MUL1_FU];
-    if (ENABLE_DEBUG_MESSAGES)
+    if ((wait = lsq_wait(cpu, t)) == 0 || can_fetch(cpu, th))
     {
-      print_stage_content("MUL1_FU_STAGE", stage);
+      return 0;
     }
+    n = wait < n ? wait : n;
   }
-  return 0;
-}
-
-int multiplication2_fu(APEX_CPU *cpu)
-{
 
-   CPU_Stage *stage = &cpu->stage[MUL2_FU];
-  if (!stage->busy && !stage->stalled)
+  for (int u = 0; u < cpu->num_fus; ++u)
   {
-    if (strcmp(stage->opcode, "MUL") == 0)
+    const APEX_FU *fu = &cpu->fu[u];
+    int last = fu->first + fu->latency - 1;
+    if (!stage_latch(cpu, last)->busy)
     {
-      // stage->stalled = NONSTALLED;
+      return 0;
     }
-    cpu->stage[MUL3_FU] = cpu->stage[MUL2_FU];
-    if (ENABLE_DEBUG_MESSAGES)
+    for (int s = last - 1; s >= fu->first && last - s < n; --s)
     {
-      print_stage_content("MUL2_FU_STAGE", stage);
+      if (!stage_latch(cpu, s)->busy)
+      {
+        n = last - s;
+      }
     }
   }
-  return 0;
+  if (n < INT_MAX)
+  {
+    return n;
+  }
+  /* Nothing in flight at all, the pipeline can never move again */
+  return cpu->max_cycles > 0 ? cpu->max_cycles + 1 - cpu->clock : 0;
 }
 
-int multiplication3_fu(APEX_CPU *cpu)
+/* What kept the ROB head from retiring, for the commit slots of this
+ * cycle that went unused. With several threads, the head of the first
+ * one with anything in its ROB, or refilling if any of them is.
+ */
+static inline int
+commit_stall(const APEX_CPU *cpu)
 {
-
-  CPU_Stage *stage = &cpu->stage[MUL3_FU];
-  if (!stage->busy && !stage->stalled)
+  int refilling = 0;
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
   {
-    if (strcmp(stage->opcode, "MUL") == 0)
+    const APEX_Thread *th = &cpu->thread[t];
+    if (th->rob_head == th->rob_tail)
     {
-      stage->buffer = stage->rs1_value * stage->rs2_value;
-      // stage->stalled = NONSTALLED;
-      // pushResults(cpu, MULFU3);
-      // updtROB(cpu, MULFU3);
+      refilling |= th->refilling;
+      continue;
     }
-    if (ENABLE_DEBUG_MESSAGES)
+    switch (apex_opcode_info[cpu->rob[ROB_INDEX(cpu, t, th->rob_head)].opcode].fu)
     {
-      print_stage_content("MUL3_FU_STAGE", stage);
-      // flushStage(cpu, MULFU2);
+    case FU_MUL:
+      return CPI_MULTIPLY;
+
+    case FU_MEM:
+      return CPI_MEMORY;
+
+    default:
+      return CPI_EXECUTE;
     }
   }
-  return 0;
+  return refilling ? CPI_BRANCH : CPI_FRONTEND;
 }
 
-int branch_fu(APEX_CPU *cpu)
+/* Charges n cycles of commit slots, retired of them used, to the CPI
+ * stack, and adds n cycles of the current queue occupancy
+ */
+static inline void
+count_cycles(APEX_CPU *cpu, int retired, int n)
 {
+  APEX_Stats *stats = &cpu->stats;
+  stats->cpi[CPI_BASE] += retired;
+  stats->cpi[commit_stall(cpu)] += (uint64_t)n * cpu->config.commit_width - retired;
+  count_width(cpu, WIDTH_COMMIT, retired, n);
+  stats->iq += (uint64_t)n * __builtin_popcountll(cpu->iq_valid);
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    const APEX_Thread *th = &cpu->thread[t];
+    stats->rob += (uint64_t)n * (th->rob_tail - th->rob_head);
+    stats->lsq += (uint64_t)n * (th->lsq_tail - th->lsq_head);
+  }
+  stats->prf += (uint64_t)n * (cpu->config.prf_regs - __builtin_popcountll(cpu->prf_free));
+}
 
-  CPU_Stage *stage = &cpu->stage[BR];
-
-     /* Store */
-    if (strcmp(stage->opcode, "BZ") == 0)
+/* Moves the functional units and the clock n idle cycles forward */
+static void
+skip_cycles(APEX_CPU *cpu, int n)
+{
+  for (int i = 0; i < n && i < FU_MAX_LATENCY; ++i)
+  {
+    for (int u = 0; u < cpu->num_fus; ++u)
     {
+      const APEX_FU *fu = &cpu->fu[u];
+      for (int s = fu->first + fu->latency - 2; s >= fu->first; --s)
+      {
+        if (!stage_latch(cpu, s)->busy)
+        {
+          advance_stage(cpu, s, s + 1);
+        }
+      }
     }
-
-    /* LOAD */
-    if (strcmp(stage->opcode, "BNZ") == 0)
+  }
+  if (tracing(cpu))
+  {
+    APEX_Trace_Record record = {.clock = cpu->clock, .pc = cpu->clock + n - 1,
+                                .event = TRACE_IDLE};
+    trace_event(cpu, &record);
+  }
+  /* Decode keeps failing to dispatch for the same reason throughout, and
+   * no instruction enters or leaves a functional unit
+   */
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    APEX_Thread *th = &cpu->thread[t];
+    if (th->fetch_head != th->fetch_tail)
     {
+      CPU_Stage *next = &th->fetch_buffer[th->fetch_head & FETCH_BUFFER_MASK];
+      cpu->stalls[dispatch_stall(cpu, t, next)] += n;
+      cpu->stats.occupancy[DRD] += (uint64_t)n * (th->fetch_tail - th->fetch_head);
     }
+  }
+  count_width(cpu, WIDTH_FETCH, 0, n);
+  count_width(cpu, WIDTH_DECODE, 0, n);
+  count_width(cpu, WIDTH_ISSUE, 0, n);
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    for (int s = cpu->fu[u].first; s < cpu->fu[u].first + cpu->fu[u].latency; ++s)
+    {
+      cpu->stats.fu_occupancy[u] += (uint64_t)n * !stage_latch(cpu, s)->busy;
+    }
+  }
+  /* A load still waiting for the port can only be short of an MSHR */
+  unsigned int port;
+  if (port_thread(cpu, &port) >= 0)
+  {
+    cpu->cache.mshr_stalls += n;
+  }
+  count_cycles(cpu, 0, n);
+  cpu->clock += n;
+  cpu->skipped_cycles += n;
+}
 
-    /* LDR */
-    if (strcmp(stage->opcode, "JUMP") == 0)
+/* Returns 1 once fetch has run off the end of code memory on some thread
+ * and retired everything before that point, and every other thread has
+ * done the same or retired HALT
+ */
+static int
+threads_done(const APEX_CPU *cpu)
+{
+  int ran_off = 0;
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    const APEX_Thread *th = &cpu->thread[t];
+    int end = th->rob_head == th->rob_tail && th->fetch_head == th->fetch_tail &&
+              (unsigned)get_code_index(th->pc) >= (unsigned)cpu->code_memory_size;
+    if (!end && !th->halted)
     {
+      return 0;
     }
-  return 0;
+    ran_off |= end;
+  }
+  return ran_off;
 }
 
 /*
- *  Memory Stage of APEX Pipeline
+ *  APEX CPU simulation loop
  *
  *  Note : You are free to edit this function according to your
  * 				 implementation
+ *
+ *  Runs the pipeline until HALT retires on every thread, the cycle budget
+ *  is used up or fetch runs off the end of code memory, without reporting
+ *  anything.
+ *  Returns -1 if the trace or samples asked for could not be written.
  */
-int memory(APEX_CPU *cpu)
+int APEX_cpu_simulate(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[MEM];
-  if (!stage->busy && !stage->stalled)
+  if (cpu->config.samples[0] && !(cpu->samples = APEX_samples_open(cpu)))
   {
-
-
-     /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0)
+    return -1;
+  }
+  if (cpu->config.trace[0] && !(cpu->trace = APEX_trace_open(cpu->config.trace, cpu)))
+  {
+    if (cpu->samples)
     {
+      APEX_samples_close(cpu);
     }
+    return -1;
+  }
+  cpu->next_sample = cpu->samples ? cpu->clock + cpu->config.interval : INT_MAX;
+  int status = 0;
 
-    /* LOAD */
-    if (strcmp(stage->opcode, "LOAD") == 0)
+  while (!cpu->halted && (cpu->max_cycles <= 0 || cpu->clock <= cpu->max_cycles))
+  {
+    if (cpu->clock == cpu->next_sample)
     {
+      APEX_samples_take(cpu);
     }
 
-    /* LDR */
-    if (strcmp(stage->opcode, "LDR") == 0)
+    if (cpu->config.skip_idle)
     {
+      int n = idle_cycles(cpu);
+      if (cpu->max_cycles > 0 && n > cpu->max_cycles + 1 - cpu->clock)
+      {
+        n = cpu->max_cycles + 1 - cpu->clock;
+      }
+      if (n > cpu->next_sample - cpu->clock)
+      {
+        n = cpu->next_sample - cpu->clock;
+      }
+      if (n > 0)
+      {
+        skip_cycles(cpu, n);
+        continue;
+      }
     }
 
-    /* STR */
-    if (strcmp(stage->opcode, "STR") == 0)
+    if (tracing(cpu))
     {
+      APEX_Trace_Record record = {.clock = cpu->clock, .event = TRACE_CYCLE};
+      trace_event(cpu, &record);
     }
 
-    /* Copy data from decode latch to execute latch*/
-    // cpu->stage[WB] = cpu->stage[MEM];
+    int retired = cpu->ins_completed;
+    commit(cpu);
 
-    if (ENABLE_DEBUG_MESSAGES)
+    /* Fetch ran off the end of code memory without a HALT and everything
+     * before that point has retired, on every thread that did not halt
+     */
+    if (threads_done(cpu))
     {
-      print_stage_content("Memory", stage);
+      break;
     }
+    count_cycles(cpu, cpu->ins_completed - retired, 1);
+
+    memory(cpu);
+    execute(cpu);
+    issue(cpu);
+    decode(cpu);
+    fetch(cpu);
+    cpu->clock++;
   }
-  return 0;
-}
 
-// /*
-//  *  Writeback Stage of APEX Pipeline
-//  *
-//  *  Note : You are free to edit this function according to your
-//  * 				 implementation
-//  */
-// int
-// writeback(APEX_CPU* cpu)
-// {
-//   CPU_Stage* stage = &cpu->stage[WB];
-//   if (!stage->busy && !stage->stalled) {
-
-//     /* Update register file */
-//     if (strcmp(stage->opcode, "MOVC") == 0) {
-//       cpu->regs[stage->rd] = stage->buffer;
-//     }
-
-//     cpu->ins_completed++;
-
-//     if (ENABLE_DEBUG_MESSAGES) {
-//       print_stage_content("Writeback", stage);
-//     }
-//   }
-//   return 0;
-// }
+  if (cpu->trace)
+  {
+    status |= APEX_trace_close(cpu->trace);
+    cpu->trace = NULL;
+  }
+  if (cpu->samples)
+  {
+    status |= APEX_samples_close(cpu);
+  }
+  return status;
+}
 
 /*
- *  APEX CPU simulation loop
- *
- *  Note : You are free to edit this function according to your
- * 				 implementation
+ * Simulates cpu and prints a summary of the run
  */
 int APEX_cpu_run(APEX_CPU *cpu)
 {
-  while (cpu->clock <= cpu->code_memory_size)
+  if (cpu->fast_forwarded)
   {
+    printf("(apex) >> Fast-forwarded %lld instructions to pc(%d)\n",
+           cpu->fast_forwarded, cpu->thread[0].pc);
+  }
+  int status = APEX_cpu_simulate(cpu);
 
-    /* All the instructions committed, so exit */
-    if (cpu->ins_completed == cpu->code_memory_size)
-    {
-      printf("(apex) >> Simulation Complete");
-      break;
-    }
-
-    if (ENABLE_DEBUG_MESSAGES)
+  if (cpu->halted)
+  {
+    printf("(apex) >> Simulation Complete\n");
+  }
+  printf("(apex) >> %d instructions retired in %d cycles\n",
+         cpu->ins_completed, cpu->clock - cpu->start_clock);
+  if (cpu->config.smt_threads > 1)
+  {
+    printf("(apex) >> %d threads, %s fetch, retired", cpu->config.smt_threads,
+           APEX_fetch_policy_name(cpu->config.fetch_policy));
+    for (int t = 0; t < cpu->config.smt_threads; ++t)
     {
-      printf("--------------------------------\n");
-      printf("Clock Cycle #: %d\n", cpu->clock);
-      printf("--------------------------------\n");
+      printf("%s %d", t ? "," : "", cpu->thread[t].ins_completed);
     }
-
-    // writeback(cpu);
-    // memory(cpu);
-
-    branch_fu(cpu);
-    multiplication3_fu(cpu);
-    multiplication2_fu(cpu);
-    multiplication1_fu(cpu);
-    integer2_fu(cpu);
-    integer1_fu(cpu);
-    decode(cpu);
-    fetch(cpu);
-    cpu->clock++;
+    printf("\n");
+  }
+  if (cpu->config.skip_idle)
+  {
+    printf("(apex) >> %d idle cycles skipped\n", cpu->skipped_cycles);
+  }
+  printf("(apex) >> Dispatch stalls: ROB %u, IQ %u, LSQ %u, PRF %u, BIS %u\n",
+         cpu->stalls[STALL_ROB], cpu->stalls[STALL_IQ], cpu->stalls[STALL_LSQ],
+         cpu->stalls[STALL_PRF], cpu->stalls[STALL_BIS]);
+  APEX_stats_print_units(cpu);
+  APEX_predictor_print_stats(cpu);
+  APEX_cache_print_stats(cpu);
+  if (cpu->config.uop_cache)
+  {
+    printf("(apex) >> Uop cache %d entries: %.2f%% hit rate over %u lookups, "
+           "%u taken branches streamed\n",
+           cpu->config.uop_cache,
+           cpu->uop.lookups ? 100.0 * cpu->uop.hits / cpu->uop.lookups : 0.0,
+           cpu->uop.lookups, cpu->uop.streamed);
   }
 
-  return 0;
+  if (cpu->config.stats[0] && APEX_stats_write(cpu, cpu->config.stats) != 0)
+  {
+    status = -1;
+  }
+  if (cpu->config.checkpoint[0] && APEX_cpu_save(cpu, cpu->config.checkpoint) == 0)
+  {
+    printf("(apex) >> Checkpoint written to %s\n", cpu->config.checkpoint);
+  }
+  if (cpu->config.trace[0] && status == 0)
+  {
+    printf("(apex) >> Trace written to %s\n", cpu->config.trace);
+  }
+  return status;
 }
\ No newline at end of file
@@ -9,312 +9,971 @@
  *  State University of New York, Binghamton
  */
 
-#define IQ_Entries 8
-#define LSQ_Entries 6
-#define PRF 24 // Physical Registers
+#include <stddef.h>
+#include <stdint.h>
+
+#define IQ_MAX_ENTRIES 64 // One bit each in the IQ masks
+#define LSQ_MAX_ENTRIES 64 // Power of two
+#define PRF_MAX 64 // Physical Registers, one bit each in the PRF masks
 #define ARF 16 //Architectural Registers
-#define ROB_Entries 12
-#define RAT_Entries 16
-#define BIS_Entries 12 //Related to Reorder Buffer
-#define BTB_Entries 2  //Prediction of at least 2 branches
+#define ROB_MAX_ENTRIES 256 // Power of two, indices fit in a uint8_t
+#define RAT_Entries (ARF + 1) // R0-R15 and the zero flag
+#define BIS_MAX_ENTRIES 64 // One bit each in bis_valid
+#define FU_MAX_UNITS 4 // Instances of one functional unit class
+#define FU_MAX_LATENCY 8 // Pipeline stages of one functional unit
+#define FU_MAX_COUNT (3 * FU_MAX_UNITS) // Units of FU_INT, FU_MUL and FU_BR
+#define BTB_MAX_SETS 256 // Power of two
+#define BTB_MAX_WAYS 8
+#define PHT_MAX_BITS 14 // log2 of the largest pattern history table
+#define TAGE_TABLES 4 // Tagged TAGE components
+#define TAGE_BITS 10 // log2 of entries per tagged component
+#define DATA_MEMORY_SIZE 4096 // Default words of data memory
+#define DATA_MEMORY_MAX_WORDS (1 << 30) // Power of two, the largest address space
+#define PAGE_BITS 10 // log2 of words per data memory page
+#define PAGE_WORDS (1 << PAGE_BITS)
+#define TABLE_BITS 10 // log2 of page pointers per second-level page table
+#define PAGE_DIR_ENTRIES (DATA_MEMORY_MAX_WORDS >> (PAGE_BITS + TABLE_BITS))
+#define CACHE_MAX_LINES 8192 // Lines of all data cache levels together
+#define CACHE_MAX_WAYS 16
+#define CACHE_MAX_LINE_WORDS 64 // Power of two
+#define CACHE_MAX_LATENCY 1000 // Cycles of a cache level or of memory
+#define MSHR_MAX 16 // Outstanding L1D misses
+#define CORES_MAX 32 // Multicore cores, one bit each in a directory entry
+#define DIRECTORY_ENTRIES 65536 // Power of two, L1D lines the coherence directory tracks
+#define QUANTUM_MAX 1000000 // Cycles between Multicore synchronisations
+#define WIDTH_MAX 8 // Instructions fetched or decoded per cycle
+#define FETCH_BUFFER_MAX 32 // Power of two
+#define WIDTH_BINS 16 // Per-cycle width histogram, the last bin counts that many or more
+#define UOP_CACHE_MAX 1024 // Power of two, decoded instructions held in front of fetch
+#define SMT_MAX 3 // Hardware threads of one core, each needs RAT_Entries of the PRF
+
+/* The zero flag is renamed as one more register after the ARF, so that
+ * BZ/BNZ wait on it through the same scoreboard as any other source
+ */
+#define Z_FLAG_REG ARF
+#define NO_TAG 0xFF // Unused source or destination tag
 
+/* regs[] slot that instructions without a destination retire into, so
+ * commit can write unconditionally
+ */
+#define SINK_REG 31
+
+/* Set this flag to 1 to print the pipeline every cycle by default */
+#define ENABLE_DEBUG_MESSAGES 1
+
+#define IQ_ENTRIES 8 // Default structure sizes
+#define LSQ_ENTRIES 8
+#define PRF_REGS 24
+#define ROB_ENTRIES 16
+#define BIS_ENTRIES 12
+#define INT_UNITS 1 // Default functional units and their latencies
+#define INT_LATENCY 2
+#define MUL_UNITS 1
+#define MUL_LATENCY 3
+#define BR_UNITS 1
+#define BR_LATENCY 1
+#define FETCH_WIDTH 1 // Default instructions per cycle through each stage
+#define DECODE_WIDTH 1
+#define ISSUE_WIDTH FU_MAX_COUNT // One per functional unit
+#define COMMIT_WIDTH 1
+#define FETCH_BUFFER 0 // Default fetch buffer entries, 0 for fetch_width
+#define UOP_CACHE 0 // Default decoded instruction cache entries, none
+#define CORES 0 // Default Multicore cores, 0 for one per program listed
+#define QUANTUM 1000 // Default cycles between Multicore synchronisations
+#define CORE_REG 15 // Default register holding the core and thread number
+#define SMT_THREADS 1 // Default hardware threads per core
+#define BTB_SETS 16 // Default BTB geometry
+#define BTB_WAYS 2
+#define PHT_BITS 10 // Default log2 of pattern history table entries
+#define SAMPLE_INTERVAL 10000 // Default cycles between counter samples
+#define L1D_WORDS 0 // Default data caches, none: every load takes one cycle
+#define L1D_WAYS 2
+#define L1D_LINE 8
+#define L1D_LATENCY 2
+#define L2_WORDS 0
+#define L2_WAYS 8
+#define L2_LINE 8
+#define L2_LATENCY 10
+#define MEMORY_LATENCY 100
+#define MSHRS 4
+
+/* Bump whenever APEX_CPU changes shape, older checkpoints are rejected */
+#define APEX_CHECKPOINT_VERSION 16
+
+/* Bump whenever APEX_Instruction or the program file layout changes */
+#define APEX_PROGRAM_VERSION 1
+
+/* Bump whenever APEX_Trace_Record or the trace file layout changes */
+#define APEX_TRACE_VERSION 1
+
+/* Bump whenever the columns or the layout of binary sample files change */
+#define APEX_SAMPLES_VERSION 1
+
+/* Fixed pipeline stages. The latches of the functional units follow
+ * them, laid out at startup from the configured units and latencies.
+ * Fetch and decode hand instructions over through the fetch buffer
+ * rather than their latches.
+ */
 enum APEX_Stages
 {
   F,
   DRD,
-  INT1_FU,
-  INT2_FU,
-  MUL1_FU,
-  MUL2_FU,
-  MUL3_FU,
-  BR,
   MEM,
   NUM_STAGES
 };
 
+#define MAX_STAGES (NUM_STAGES + FU_MAX_COUNT * FU_MAX_LATENCY)
+
+/* Operation codes, decoded once by the parser */
+enum APEX_Opcode
+{
+  OP_NOP, // Empty latch or unrecognised instruction
+  OP_MOVC,
+  OP_ADD,
+  OP_SUB,
+  OP_AND,
+  OP_OR,
+  OP_EXOR,
+  OP_MUL,
+  OP_ADDL,
+  OP_SUBL,
+  OP_LOAD,
+  OP_LDR,
+  OP_STORE,
+  OP_STR,
+  OP_BZ,
+  OP_BNZ,
+  OP_JUMP,
+  OP_HALT,
+  NUM_OPCODES
+};
+
+/* Operand format classes, select which instruction fields are used */
+enum APEX_Format
+{
+  FMT_NONE,        // HALT
+  FMT_RD_IMM,      // MOVC,rd,#imm
+  FMT_RD_RS1_RS2,  // ADD,rd,rs1,rs2
+  FMT_RD_RS1_IMM,  // ADDL,rd,rs1,#imm
+  FMT_RS1_RS2_IMM, // STORE,rs1,rs2,#imm
+  FMT_RS1_RS2_RS3, // STR,rs1,rs2,rs3
+  FMT_IMM,         // BZ,#imm
+  FMT_RS1_IMM,     // JUMP,rs1,#imm
+  NUM_FORMATS
+};
+
+/* Functional unit class an opcode is issued to */
+enum APEX_FU_Class
+{
+  FU_NONE, // Never leaves decode (HALT)
+  FU_INT,  // Integer unit, result in its last stage
+  FU_MUL,  // Multiplier, result in its last stage
+  FU_BR,   // Branch unit, resolves in its last stage
+  FU_MEM,  // Integer unit for the address, then MEM
+  NUM_FU_CLASSES
+};
+
+/* Opcode property flags */
+#define OPF_WRITES_RD 0x1 // Produces a value for rd
+#define OPF_SETS_Z 0x2    // Updates the zero flag
+
+/* Static description of an opcode */
+typedef struct APEX_Opcode_Info
+{
+  const char *name;        // Assembler mnemonic
+  enum APEX_Format format; // Operand format class
+  enum APEX_FU_Class fu;   // Functional unit the opcode issues to
+  int flags;               // OPF_* properties
+} APEX_Opcode_Info;
+
+extern const APEX_Opcode_Info apex_opcode_info[NUM_OPCODES];
+
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
 {
-  char opcode[128]; // Operation Code
-  int rd;           // Destination Register Address
-  int rs1;          // Source-1 Register Address
-  int rs2;
-  int rs3; // Source-2 Register Address
-  int imm; // Literal Value
+  int32_t imm;    // Literal Value
+  uint8_t opcode; // enum APEX_Opcode
+  uint8_t format; // enum APEX_Format
+  uint8_t rd;     // Destination Register Address
+  uint8_t rs1;    // Source-1 Register Address
+  uint8_t rs2;    // Source-2 Register Address
+  uint8_t rs3;    // Source-3 Register Address
+  uint8_t pad[2];
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+/* Also the record size of binary program files, which map straight into
+ * code memory
+ */
+_Static_assert(sizeof(APEX_Instruction) == 12, "APEX_Instruction must stay 12 bytes");
+
+/* Model of CPU stage latch
+ *
+ * Packed to 32 bytes so two latches share a cache line. Architectural
+ * register numbers are only needed for printing, so they are read from
+ * code memory through pc instead of being carried down the pipeline.
+ */
 typedef struct CPU_Stage
 {
-  int pc;           // Program Counter
-  char opcode[128]; // Operation Code
-  int rs1;          // Source-1 Register Address
-  int p1;           // Source-1 Physical Register Address
-  int p1_valid;
-  int rs2; // Source-2 Register Address
-  int p2;  // Source-2 Physical Register Address
-  int p2_valid;
-  int rs3; // Source-3 Register Address
-  int p3;  // Source-3 Physical Register Address
-  int p3_valid;
-  int rd;          // Architectural Destination Register Address
-  int prd;         //Physical Destination Register Address
-  int imm;         // Literal Value
-  int rs1_value;   // Source-1 Register Value
-  int rs2_value;   // Source-2 Register Value
-  int rs3_value;   // Source-3 Register Value
-  int buffer;      // Latch to hold some value
-  int mem_address; // Computed Memory Address
-  int busy;        // Flag to indicate, stage is performing some action
-  int stalled;     // Flag to indicate, stage is stalled
-  // enum APEX_Stages stages;
+  int pc;                // Program Counter, locates the decoded instruction
+  int imm;               // Literal Value
+  int rs1_value;         // Source-1 Register Value
+  int rs2_value;         // Source-2 Register Value
+  int rs3_value;         // Source-3 Register Value
+  int buffer;            // Latch to hold some value, predicted next pc when fetched
+  uint8_t opcode;        // enum APEX_Opcode
+  uint8_t prd;           // Physical Destination Register Address
+  uint8_t p1;            // Source-1 Physical Register Address
+  uint8_t p2;            // Source-2 Physical Register Address
+  uint8_t p3;            // Source-3 Physical Register Address
+  uint8_t busy : 1;      // Flag to indicate, stage is performing some action
+  uint8_t stalled : 1;   // Flag to indicate, stage is stalled
+  uint8_t rob;           // ROB index
+  uint8_t lsq;           // LSQ index, memory operations only
 } CPU_Stage;
 
-/*Format of IQ Entry*/
-typedef struct IQ_Entry
+_Static_assert(sizeof(CPU_Stage) == 32, "CPU_Stage should pack two latches per cache line");
+
+/* Why the oldest instruction in the fetch buffer could not dispatch in a
+ * cycle
+ */
+enum APEX_Stall
 {
+  STALL_NONE,
+  STALL_ROB, // Reorder buffer full
+  STALL_IQ,  // Issue queue full
+  STALL_LSQ, // Load/store queue full
+  STALL_PRF, // No free physical register
+  STALL_BIS, // No free branch checkpoint
+  NUM_STALLS
+};
 
+/* Format of IQ Entry
+ *
+ * Source values are captured either at dispatch or when their tag is
+ * broadcast, so an entry never reads the register file at issue.
+ */
+typedef struct IQ_Entry
+{
   int pc;
-  int opcode[128];
-  int iq_size[IQ_Entries];
-  int head;        //front in Array
-  int tail;        //rear in Array
-  int rs1;         // Source-1 Register Address
-  int p1;          // Source-1 Physical Register Address
-  int p1_valid;    //valid bit
-  int rs2;         // Source-2 Register Address
-  int p2;          // Source-2 Physical Register Address
-  int p2_valid;    //valid bit
-  int rs3;         // Source-3 Register Address
-  int p3;          // Source-3 Physical Register Address
-  int p3_valid;    //valid bit
-  int rd;          // Architectural Destination Register Address
-  int prd;         //Physical Destination Register Address
   int imm;         // Literal Value
   int rs1_value;   // Source-1 Register Value
   int rs2_value;   // Source-2 Register Value
   int rs3_value;   // Source-3 Register Value
-  int buffer;      // Latch to hold some value
-  int mem_address; // Computed Memory Address
-  enum APEX_Stages stages;
-
+  uint64_t wait;   // Source tags still outstanding, one bit per PRF
+  uint8_t opcode;  // enum APEX_Opcode
+  uint8_t prd;     // Physical Destination Register Address
+  uint8_t p1;      // Source-1 Physical Register Address
+  uint8_t p2;      // Source-2 Physical Register Address
+  uint8_t p3;      // Source-3 Physical Register Address
+  uint8_t rob;     // ROB index
+  uint8_t lsq;     // LSQ index, memory operations only
 } IQ_Entry;
 
-/*Format of IQ Entry*/
+/* Format of ROB Entry
+ *
+ * Each thread's share of the ROB is a ring indexed by the free-running
+ * rob_head/rob_tail counters in APEX_Thread, masked with its entries - 1.
+ * The release masks hold one bit each, or none, so commit frees
+ * registers without branches.
+ */
 typedef struct ROB_Entry
 {
   int pc;
-  int opcode[128];
-  int rob_size[ROB_Entries];
-  int head;        //front in Array
-  int tail;        //rear in Array
-  int rs1;         // Source-1 Register Address
-  int p1;          // Source-1 Physical Register Address
-  int p1_valid;    //valid bit
-  int rs2;         // Source-2 Register Address
-  int p2;          // Source-2 Physical Register Address
-  int p2_valid;    //valid bit
-  int rs3;         // Source-3 Register Address
-  int p3;          // Source-3 Physical Register Address
-  int p3_valid;    //valid bit
-  int rd;          // Architectural Destination Register Address
-  int prd;         //Physical Destination Register Address
-  int imm;         // Literal Value
-  int rs1_value;   // Source-1 Register Value
-  int rs2_value;   // Source-2 Register Value
-  int rs3_value;   // Source-3 Register Value
-  int buffer;      // Latch to hold some value
-  int mem_address; // Computed Memory Address
-  int mem_address_valid;
+  int result;        // Value retired into regs[rd]
+  uint64_t rd_release; // Previous mapping of rd, released at commit
+  uint64_t z_release;  // Previous mapping of the zero flag, released at commit
+  uint8_t opcode;    // enum APEX_Opcode
+  uint8_t rd;        // Architectural Destination Register, SINK_REG if none
+  uint8_t completed; // Result is available, entry may retire
+  uint16_t dispatched; // Low 16 bits of the dispatch cycle, for latencies
 } ROB_Entry;
 
-/*Format of IQ Entry*/
+/* Format of LSQ Entry
+ *
+ * Like the ROB, each thread's share of the LSQ is a ring in program
+ * order indexed by the free-running lsq_head/lsq_tail counters in
+ * APEX_Thread.
+ */
 typedef struct LSQ_Entry
 {
   int pc;
-  int opcode[128];
-  int lsq_size[LSQ_Entries];
-  int head;             //front in Array
-  int tail;             //rear in Array
-  int rs1;              // Source-1 Register Address
-  int p1;               // Source-1 Physical Register Address
-  int p1_valid;         //valid bit
-  int rs2;              // Source-2 Register Address
-  int p2;               // Source-2 Physical Register Address
-  int p2_valid;         //valid bit
-  int rs3;              // Source-3 Register Address
-  int p3;               // Source-3 Physical Register Address
-  int p3_valid;         //valid bit
-  int rd;               // Architectural Destination Register Address
-  int prd;              //Physical Destination Register Address
-  int imm;              // Literal Value
-  int rs1_value;        // Source-1 Register Value
-  int rs2_value;        // Source-2 Register Value
-  int rs3_value;        // Source-3 Register Value
-  int buffer;           // Latch to hold some value
-  int mem_address;      // Computed Memory Address
-  int mem_address_valid; //valid bit
+  int mem_address;            // Computed Memory Address
+  int data;                   // Store data, or the value a load read
+  unsigned int source;        // LSQ position of the store a load forwarded from
+  uint8_t opcode;             // enum APEX_Opcode
+  uint8_t rob;                // ROB index
+  uint8_t prd;                // Physical Destination Register Address
+  int ready;                  // Cycle a load's value arrives from the caches
+  uint8_t mem_address_valid;  // Address and store data are known
+  uint8_t executed;           // Load has read its value
+  uint8_t forwarded;          // Load value came from an older store
+  uint8_t completed;          // Load value has been broadcast
 } LSQ_Entry;
 
-/*Format of IQ Entry*/
+/* Format of Branch Target Buffer Entry */
 typedef struct BTB_Entry
 {
-  int pc;
-  int opcode[128];
-  int btb_size[BTB_Entries];
-  int imm;
-  int memory_address;
-  int mem_address_valid;
-  int next_predicted_path; //Instruction to be fetched if branch is predicted correctly
-  int status;  //taken or not taken
+  int pc;             // Branch address, 0 when the way is empty
+  int target;         // Last taken target
+  unsigned int used;  // BTB tick of the last hit or fill, for LRU replacement
 } BTB_Entry;
 
-/*Format of Branch Instruction Stack Entry*/
+/* Format of a tagged TAGE component entry */
+typedef struct TAGE_Entry
+{
+  uint8_t tag;
+  int8_t ctr;   // 3-bit signed counter, taken when >= 0
+  uint8_t u;    // 2-bit usefulness
+} TAGE_Entry;
+
+/* Direction predictors selectable with predictor=<name> */
+typedef enum APEX_Predictor_Kind
+{
+  PRED_STATIC,  // Backward taken, forward not taken
+  PRED_BIMODAL, // 2-bit counters indexed by pc
+  PRED_GSHARE,  // 2-bit counters indexed by pc xor global history
+  PRED_TAGE,    // Bimodal base plus tagged geometric-history components
+  NUM_PREDICTORS
+} APEX_Predictor_Kind;
+
+/* Branch prediction state. Everything lives inline so the CPU stays a
+ * single flat allocation.
+ */
+typedef struct APEX_Predictor
+{
+  uint64_t history[SMT_MAX];         // Speculative global history per thread, newest in bit 0
+  uint8_t pht[1 << PHT_MAX_BITS];    // 2-bit counters, also the TAGE base
+  TAGE_Entry tage[TAGE_TABLES][1 << TAGE_BITS];
+  BTB_Entry btb[BTB_MAX_SETS * BTB_MAX_WAYS];
+  unsigned int btb_tick;             // Counts BTB hits and fills, also during Fastforward
+
+  /* Statistics */
+  unsigned int branches;       // Control instructions resolved
+  unsigned int mispredicts;    // Of those, redirected after the fact
+  unsigned int btb_lookups;    // Control instructions fetched
+  unsigned int btb_hits;
+  unsigned int penalty_cycles; // Rename-to-redirect cycles of mispredicts
+  unsigned int squashed;       // Instructions thrown away by mispredicts
+} APEX_Predictor;
+
+/* Format of Branch Instruction Stack Entry
+ *
+ * A checkpoint taken when a BZ/BNZ/JUMP is renamed. The free list is not
+ * copied: alloc collects every physical register handed out after the
+ * branch, which is exactly what a misprediction returns to the free list.
+ */
 typedef struct BIS_Entry
 {
-  int pc;
-  int top;
-  int bottom;
-  int opcode[128];
-  int bis_size[BIS_Entries];
-  int imm;
-  int memory_address;
-  int mem_address_valid;
-  int status;  //taken or not taken - save in BTB if is taken
+  uint8_t rat[RAT_Entries]; // Rename table after the branch
+  uint8_t rob;              // ROB index of the branch
+  int predicted_pc;         // Address fetch continued from
+  uint64_t history;         // Global history the branch was predicted with
+  int cycle;                // Clock when the branch was renamed
+  unsigned int lsq_tail;    // LSQ tail after the branch
+  uint64_t alloc;           // Physical registers allocated after the branch
+  uint64_t iq;              // IQ entries dispatched after the branch
 } BIS_Entry;
 
-/*Format of Rename Table*/
-typedef struct RAT
+/* Levels of the data cache hierarchy, L1D nearest the memory stage */
+enum APEX_Cache_Level
 {
-  int rat_size[RAT_Entries];
-  int rd;
-  int rd_valid;
-  int prd;
-  int prd_valid;
+  CACHE_L1D,
+  CACHE_L2,
+  NUM_CACHE_LEVELS
+};
 
-} RAT;
+/* Replacement policies selectable with l1d_policy and l2_policy */
+typedef enum APEX_Cache_Policy
+{
+  CACHE_LRU,    // Least recently used way
+  CACHE_FIFO,   // Way filled longest ago
+  CACHE_RANDOM, // Pseudo-random way, the same for every run
+  NUM_CACHE_POLICIES
+} APEX_Cache_Policy;
+
+/* How fetch picks the hardware thread it fetches from each cycle,
+ * selectable with fetch_policy
+ */
+typedef enum APEX_Fetch_Policy
+{
+  FETCH_ROUND_ROBIN, // The next thread after the last one fetched that can fetch
+  FETCH_ICOUNT,      // The thread with the fewest instructions in decode and the IQ
+  NUM_FETCH_POLICIES
+} APEX_Fetch_Policy;
 
-/* Model of APEX CPU */
-typedef struct APEX_CPU
+/* Microarchitecture parameters chosen at startup */
+typedef struct APEX_Config
 {
-  /* Clock cycles elasped */
-  int clock;
+  int verbose;      // Print code memory and every stage each cycle
+  int threads;      // Batch, Sweep and Multicore threads, 0 for one per host core
+  int cores;        // Multicore cores, 0 for one per program listed
+  int quantum;      // Multicore cycles between synchronisations
+  int core_reg;     // Register that starts out holding the core and thread number
+  int smt_threads;  // Hardware threads per core
+  int fetch_policy; // APEX_Fetch_Policy
+  int iq_entries;
+  int lsq_entries;  // Power of two
+  int prf_regs;     // Physical registers
+  int rob_entries;  // Power of two
+  int bis_entries;
+  int fu_units[NUM_FU_CLASSES];   // Instances of FU_INT, FU_MUL and FU_BR
+  int fu_latency[NUM_FU_CLASSES]; // Pipeline stages of each, one cycle apiece
+  int fu_pipelined[NUM_FU_CLASSES]; // 0 if a unit holds one instruction at a time
+  int fetch_width;  // Instructions fetched per cycle
+  int fetch_buffer; // Entries between fetch and decode, 0 for fetch_width
+  int decode_width; // Instructions renamed and dispatched per cycle
+  int issue_width;  // Instructions leaving the IQ per cycle
+  int commit_width; // Instructions retired per cycle
+  int predictor;    // APEX_Predictor_Kind
+  int btb_sets;     // Power of two
+  int btb_ways;
+  int pht_bits;     // log2 of pattern history table entries
+  int skip_idle;    // Jump the clock over cycles where nothing can happen
+  int ff_insns;     // Fastforward: instructions to interpret, 0 for no limit
+  int ff_pc;        // Fastforward: address to stop at, 0 for none
+  char checkpoint[256]; // File the final state is saved to, empty for none
+  char trace[256];      // File stage events are recorded to, empty for none
+  char stats[256];      // File the counters are written to as JSON, - for stdout
+  char samples[256];    // File the counters are sampled into, empty for none
+  int interval;         // Cycles between samples
+  int memory_words;     // Data memory size, power of two
+  int cache_words[NUM_CACHE_LEVELS];   // Capacity of L1D and L2, 0 for none
+  int cache_ways[NUM_CACHE_LEVELS];
+  int cache_line[NUM_CACHE_LEVELS];    // Words per line, power of two
+  int cache_latency[NUM_CACHE_LEVELS]; // Cycles of a hit
+  int cache_policy[NUM_CACHE_LEVELS];  // APEX_Cache_Policy
+  int memory_latency;                  // Cycles past the last cache level
+  int mshrs;                           // L1D misses in flight at once
+  int uop_cache;    // Decoded instruction cache entries, power of two, 0 for none
+} APEX_Config;
+
+/* What each commit slot of a cycle went to. Slots that retired nothing
+ * are charged to whatever held up the ROB head, so the stack adds up to
+ * commit_width slots per cycle.
+ */
+enum APEX_Cpi
+{
+  CPI_BASE,     // Retired an instruction
+  CPI_FRONTEND, // ROB empty, fetch and decode had nothing to dispatch
+  CPI_BRANCH,   // ROB empty, refilling after a misprediction
+  CPI_EXECUTE,  // Head waiting on an integer or branch unit result
+  CPI_MULTIPLY, // Head waiting on a multiplier
+  CPI_MEMORY,   // Head is a load or store still in flight
+  NUM_CPI
+};
+
+/* Stages with a configured width, for the width histograms */
+enum APEX_Width
+{
+  WIDTH_FETCH,
+  WIDTH_DECODE,
+  WIDTH_ISSUE,
+  WIDTH_COMMIT,
+  NUM_WIDTHS
+};
+
+/* Performance counters. Always counted, reported with stats=FILE. */
+typedef struct APEX_Stats
+{
+  uint64_t occupancy[NUM_STAGES];        // Instruction-cycles in each fixed stage
+  uint64_t fu_occupancy[FU_MAX_COUNT];   // Instruction-cycles in each unit of cpu->fu
+  uint64_t fu_issued[FU_MAX_COUNT];      // Instructions issued to each unit of cpu->fu
+  uint64_t fu_busy[NUM_FU_CLASSES];      // Cycles ready entries found every unit taken
+  uint64_t iq;                           // Entries in use, summed over cycles
+  uint64_t rob;
+  uint64_t lsq;
+  uint64_t prf;                          // Physical registers allocated
+  uint64_t cpi[NUM_CPI];                 // Commit slots by enum APEX_Cpi
+  uint64_t opcode_count[NUM_OPCODES];    // Instructions retired
+  uint64_t opcode_latency[NUM_OPCODES];  // Dispatch-to-retire cycles of those
+  uint64_t width[NUM_WIDTHS][WIDTH_BINS]; // Cycles each stage handled n instructions
+} APEX_Stats;
+
+/* What a trace record reports */
+enum APEX_Trace_Event
+{
+  TRACE_CYCLE,          // Start of cycle clock
+  TRACE_IDLE,           // Cycles clock to pc skipped as idle
+  TRACE_FETCH,
+  TRACE_DECODE,         // Renamed and dispatched
+  TRACE_DECODE_STALLED, // Held in decode, not renamed yet
+  TRACE_FU,             // Latch latch of functional unit unit
+  TRACE_MEMORY,
+};
+
+/* unit of a TRACE_FU record packs the class and instance of the unit */
+#define TRACE_UNIT(fu, unit) ((uint8_t)((fu) << 4 | (unit)))
+#define TRACE_UNIT_CLASS(unit) ((unit) >> 4)
+#define TRACE_UNIT_INSTANCE(unit) ((unit) & 0xF)
+
+/* One stage event: an instruction seen in a stage during a cycle, with
+ * the tags it was renamed to
+ */
+typedef struct APEX_Trace_Record
+{
+  int32_t clock;
+  int32_t pc;
+  uint8_t event;  // enum APEX_Trace_Event
+  uint8_t opcode;
+  uint8_t unit;   // TRACE_UNIT of TRACE_FU records
+  uint8_t latch;  // Latch within the unit, from 0
+  uint8_t prd;
+  uint8_t p1;
+  uint8_t p2;
+  uint8_t p3;
+} APEX_Trace_Record;
+
+_Static_assert(sizeof(APEX_Trace_Record) == 16, "trace records must stay 16 bytes");
+
+/* Trace file being written, see trace.c */
+typedef struct APEX_Trace APEX_Trace;
+
+/* Counter samples being collected, see stats.c */
+typedef struct APEX_Samples APEX_Samples;
+
+/* Sparse data memory. Pages are allocated on first store behind a
+ * two-level page table; the page the last access landed on is kept at
+ * hand, since loads and stores mostly stay on one page for a while.
+ */
+typedef struct APEX_Memory
+{
+  int **dir[PAGE_DIR_ENTRIES]; // Second-level tables, NULL until used
+  int *last_page;              // Page of the last access
+  int last_number;             // Its page number, -1 for none
+  int size;                    // Words addressable
+  int pages;                   // Pages allocated
+  unsigned int out_of_range;   // Retired loads and stores outside size
+} APEX_Memory;
+
+/* Tag of one cache line. Caches only model timing, the values always
+ * come from data memory.
+ */
+typedef struct Cache_Line
+{
+  unsigned int tag;       // Line address + 1, 0 when the way is empty
+  unsigned int used : 31; // Access count at the last hit (LRU) or the fill (FIFO)
+  unsigned int dirty : 1;
+} Cache_Line;
+
+/* One level of the data cache hierarchy, set-associative over a run of
+ * ways in APEX_Cache.lines
+ */
+typedef struct Cache_Level
+{
+  int first;      // Index of its first line
+  int sets;       // Power of two
+  int ways;
+  int line_shift; // log2 of words per line
+
+  /* Statistics */
+  unsigned int accesses;   // Loads, stores and writebacks from above
+  unsigned int misses;
+  unsigned int writebacks; // Dirty lines evicted
+} Cache_Level;
+
+/* Miss status holding register: an L1D line being filled */
+typedef struct MSHR_Entry
+{
+  unsigned int line; // L1D line address
+  int ready;         // Cycle the fill arrives, free from then on
+} MSHR_Entry;
+
+/* Data cache hierarchy between the memory stage and data memory. Like
+ * the predictor it lives inline, sized for the largest configuration.
+ */
+typedef struct APEX_Cache
+{
+  Cache_Line lines[CACHE_MAX_LINES];
+  Cache_Level level[NUM_CACHE_LEVELS];
+  int levels;           // Levels configured, 0 for none
+  MSHR_Entry mshr[MSHR_MAX];
+  unsigned int tick;    // Accesses so far, orders lines for replacement
+  uint32_t seed;        // State of random replacement
+
+  /* Statistics */
+  unsigned int merged;      // L1D misses that joined one already in flight
+  unsigned int mshr_stalls; // Cycles a load missed with every MSHR taken
+  unsigned int coherence_misses; // Accesses to a line another core wrote since
+  unsigned int invalidations;    // Copies of other cores a store invalidated
+} APEX_Cache;
+
+/* What the cores of Multicore share: one data memory and a directory of
+ * which cores may hold each L1D line. Cores on different host threads
+ * use the memory without locks: a page is installed with a
+ * compare-and-swap on its first store and never freed while the cores
+ * run, and readers find it with acquire loads. Lines DIRECTORY_ENTRIES
+ * apart share a directory entry.
+ */
+typedef struct APEX_Shared
+{
+  APEX_Memory memory;
+  uint32_t directory[DIRECTORY_ENTRIES]; // One bit per core
+} APEX_Shared;
+
+/* Decoded instruction cache and loop stream buffer in front of fetch,
+ * direct mapped on the code index. Code memory is decoded when the
+ * program loads, so only which instructions it holds is modelled. A
+ * predicted taken branch found in it does not end the fetch group when
+ * its target is there too, so a captured loop streams at fetch_width.
+ */
+typedef struct APEX_Uop_Cache
+{
+  int tag[UOP_CACHE_MAX]; // Code index + 1 of the instruction held, 0 if empty
+
+  /* Statistics */
+  unsigned int lookups;
+  unsigned int hits;
+  unsigned int streamed; // Predicted taken branches fetched through
+} APEX_Uop_Cache;
+
+/* A functional unit: a run of latency stage latches. An instruction
+ * issued into the first latch finishes in the last one latency cycles
+ * later. A pipelined unit takes a new instruction whenever its first
+ * latch is empty, an unpipelined one only once all of them are.
+ */
+typedef struct APEX_FU
+{
+  uint8_t fu;      // enum APEX_FU_Class
+  uint8_t unit;    // Instance number within the class
+  uint8_t first;   // Stage number of the first latch
+  uint8_t latency; // Number of latches
+} APEX_FU;
+
+/* A hardware thread: the architectural state, rename table and
+ * front end of one instruction stream. Its share of the ROB and LSQ
+ * is a ring of its own, with positions counted like the ROB and LSQ
+ * of a single-threaded CPU.
+ */
+typedef struct APEX_Thread
+{
+  /* HALT has retired */
+  int halted;
 
   /* Current program counter */
   int pc;
 
   /* Integer register file */
   int regs[32];
-  int regs_valid[32];
 
-  /* Array of 5 CPU_stage */
-  CPU_Stage stage[9];
+  /* Rename table */
+  uint8_t rat[RAT_Entries];
+
+  /* Reorder buffer and load/store queue positions */
+  unsigned int rob_head; // Oldest entry, next to retire
+  unsigned int rob_tail; // Next entry to allocate
+  unsigned int lsq_head; // Oldest entry, leaves at commit
+  unsigned int lsq_tail; // Next entry to allocate
+
+  /* Fetch has seen HALT, cleared again if HALT was on a wrong path */
+  int fetch_blocked;
+
+  /* Fetch buffer, a ring in program order like the ROB. Fetch appends
+   * up to fetch_width instructions a cycle and decode takes up to
+   * decode_width from the head.
+   */
+  CPU_Stage fetch_buffer[FETCH_BUFFER_MAX];
+  uint64_t fetch_history[FETCH_BUFFER_MAX]; // Global history before each was predicted
+  unsigned int fetch_head; // Oldest entry, next to decode
+  unsigned int fetch_tail; // Next entry to fill
+
+  /* Nothing dispatched since the last misprediction recovery */
+  int refilling;
 
-  /* Code Memory where instructions are stored */
+  /* Instructions retired */
+  int ins_completed;
+} APEX_Thread;
+
+/* Model of APEX CPU */
+typedef struct APEX_CPU
+{
+  APEX_Config config;
+
+  /* Clock cycles elasped */
+  int clock;
+
+  /* Cycle the statistics were last reset at */
+  int start_clock;
+
+  /* Cycle budget from the command line, 0 runs until HALT retires */
+  int max_cycles;
+
+  /* HALT has retired on every thread */
+  int halted;
+
+  int regs_valid[32];
+
+  /* Hardware threads. Thread t owns the ROB entries from t << rob_bits
+   * and the LSQ entries from t << lsq_bits on, everything else is shared.
+   */
+  APEX_Thread thread[SMT_MAX];
+  int rob_bits; // log2 of ROB entries per thread
+  int lsq_bits; // log2 of LSQ entries per thread
+  int fetch_thread; // Thread fetched from last
+
+  /* Latch storage for the pipeline stages. slot[s] names the latch that
+   * currently holds stage s, so advancing the pipeline swaps two slot
+   * indices instead of copying latches. Stages from NUM_STAGES up to
+   * num_stages belong to the functional units.
+   */
+  CPU_Stage stage[MAX_STAGES] __attribute__((aligned(64)));
+  uint8_t slot[MAX_STAGES];
+  int num_stages;
+
+  /* Functional units, in the order they are clocked each cycle */
+  APEX_FU fu[FU_MAX_COUNT];
+  int num_fus;
+
+  /* Code Memory where instructions are stored. code_mapped is the length
+   * of the file mapping when it comes from a binary program, else 0.
+   * Borrowed code memory belongs to the caller and is never freed.
+   */
   APEX_Instruction *code_memory;
   int code_memory_size;
+  size_t code_mapped;
+  int code_borrowed;
 
   /* Data Memory */
-  int data_memory[4096];
-
-  /* Some stats */
+  APEX_Memory memory;
+
+  /* Data caches in front of it */
+  APEX_Cache cache;
+
+  /* In Multicore, the memory and directory shared with the other cores
+   * in place of memory, and the number of this core. NULL and 0 on a
+   * single core.
+   */
+  APEX_Shared *shared;
+  int core;
+
+  /* Physical register file, with one ready bit per register */
+  int prf[PRF_MAX];
+  uint64_t prf_ready;
+
+  /* Free list. A flag-setting instruction maps both rd and the zero
+   * flag to its destination, so a physical register is only free once
+   * neither the rd nor the zero flag mapping holds it.
+   */
+  uint64_t prf_free;
+  uint64_t prf_rd_hold;
+  uint64_t prf_z_hold;
+
+  /* Branch predictor and BTB */
+  APEX_Predictor bp;
+
+  /* Branch checkpoints, bit i of bis_valid is bis[i], and those of
+   * each thread
+   */
+  BIS_Entry bis[BIS_MAX_ENTRIES];
+  uint64_t bis_valid;
+  uint64_t bis_thread[SMT_MAX];
+
+  /* Issue queue. Bit i of every mask below refers to iq[i]. */
+  IQ_Entry iq[IQ_MAX_ENTRIES];
+  uint64_t iq_valid;                  // Occupied entries
+  uint64_t iq_ready;                  // Entries with all sources available
+  uint64_t iq_fu[NUM_FU_CLASSES];     // Entries by functional unit class
+  uint64_t iq_age[IQ_MAX_ENTRIES];    // iq_age[i]: entries older than iq[i]
+  uint64_t iq_consumers[PRF_MAX];     // Entries waiting on each tag
+
+  /* Reorder buffer */
+  ROB_Entry rob[ROB_MAX_ENTRIES];
+
+  /* Load/store queue */
+  LSQ_Entry lsq[LSQ_MAX_ENTRIES];
+
+  /* Decoded instructions fetch can stream from */
+  APEX_Uop_Cache uop;
+
+  /* Some stats, over all threads */
   int ins_completed;
 
+  /* Instructions interpreted by Fastforward before the pipeline started */
+  long long fast_forwarded;
+
+  /* Cycles jumped over by skip_idle */
+  int skipped_cycles;
+
+  /* Cycles decode held an instruction it could not dispatch, by reason */
+  unsigned int stalls[NUM_STALLS];
+
+  APEX_Stats stats;
+
+  /* Trace file stage events go to while simulating, NULL for none */
+  APEX_Trace *trace;
+
+  /* Counter samples taken while simulating, NULL for none, and the cycle
+   * the next one is due at
+   */
+  APEX_Samples *samples;
+  int next_sample;
+
 } APEX_CPU;
 
 // Pipeline functions
 
 APEX_Instruction *
-create_code_memory(const char *filename, int *size);
+create_code_memory(const char *filename, int *size, uint32_t **lines);
+
+// Binary programs
+
+int APEX_program_is_binary(const char *filename);
+
+APEX_Instruction *
+APEX_program_map(const char *filename, int *size, size_t *mapped);
+
+void APEX_program_unmap(APEX_Instruction *code_memory, size_t mapped);
+
+int APEX_program_write(const char *filename, const char *source,
+                       const APEX_Instruction *code_memory, int size,
+                       const uint32_t *lines);
+
+APEX_CPU *
+APEX_cpu_init(const char* filename,const char *command, int no_of_cycles,
+              const APEX_Config *config);
 
 APEX_CPU *
-APEX_cpu_init(const char* filename,const char *command, int no_of_cycles);
+APEX_cpu_init_code(APEX_Instruction *code_memory, int size, const char *command,
+                   int no_of_cycles, const APEX_Config *config);
+
+int APEX_cpu_simulate(APEX_CPU *cpu);
 
 int APEX_cpu_run(APEX_CPU *cpu);
 
 void APEX_cpu_stop(APEX_CPU *cpu);
 
+void APEX_cpu_reset_stats(APEX_CPU *cpu);
+
+int APEX_cpu_save(const APEX_CPU *cpu, const char *filename);
+
+APEX_CPU *
+APEX_cpu_restore(const char *filename, int no_of_cycles);
+
+int get_code_index(int pc);
+
+int APEX_fetch_policy(const char *name);
+
+const char *APEX_fetch_policy_name(int policy);
+
+long long APEX_cpu_fast_forward(APEX_CPU *cpu, long long count, int stop_pc);
+
 // Stages functions
 
 int fetch(APEX_CPU *cpu);
 
 int decode(APEX_CPU *cpu);
 
-int integer1_fu(APEX_CPU *cpu);
+int execute(APEX_CPU *cpu);
 
-int integer2_fu(APEX_CPU *cpu);
+int integer_fu(APEX_CPU *cpu, CPU_Stage *stage);
 
-int multiplication1_fu(APEX_CPU *cpu);
+int multiplication_fu(APEX_CPU *cpu, CPU_Stage *stage);
 
-int multiplication2_fu(APEX_CPU *cpu);
+int branch_fu(APEX_CPU *cpu, CPU_Stage *stage);
 
-int multiplication3_fu(APEX_CPU *cpu);
+int memory(APEX_CPU *cpu);
 
-int branch_fu(APEX_CPU *cpu);
+int issue(APEX_CPU *cpu);
 
-int memory(APEX_CPU *cpu);
+int commit(APEX_CPU *cpu);
+
+// Batch, Sweep and Multicore modes
+
+int APEX_pool_run(int count, int threads, void (*job)(void *arg, int index), void *arg);
+
+int APEX_batch_run(const char *source, int no_of_cycles, const APEX_Config *config);
+
+int APEX_multicore_run(const char *source, int no_of_cycles, const APEX_Config *config);
+
+int APEX_sweep_run(const char *filename, int no_of_cycles, int nparams,
+                   const char *const *params);
+
+// Pipeline traces
+
+APEX_Trace *APEX_trace_open(const char *filename, const APEX_CPU *cpu);
+
+void APEX_trace_record(APEX_Trace *trace, const APEX_Trace_Record *record);
+
+int APEX_trace_close(APEX_Trace *trace);
+
+void APEX_trace_print(const APEX_Trace_Record *record, const APEX_Instruction *code_memory,
+                      int code_memory_size, const APEX_Config *config);
+
+void APEX_print_code_memory(const APEX_Instruction *code_memory, int size);
+
+int APEX_trace_render(const char *filename);
+
+// Data memory
+
+void APEX_memory_init(APEX_Memory *mem, int size);
+
+void APEX_memory_free(APEX_Memory *mem);
+
+int APEX_memory_read(APEX_Memory *mem, int address);
+
+void APEX_memory_write(APEX_Memory *mem, int address, int value);
 
-// Dispatch and renaming - Methods at DRD
+int APEX_memory_pages(const APEX_Memory *mem,
+                      int (*visit)(void *arg, int number, const int *page), void *arg);
 
-//sources renaming  //decoder.rename  rename.dispatch  iq.renaming.
-//decode
-//dispatch
+int APEX_memory_load_page(APEX_Memory *mem, int number, const int *words);
 
+int APEX_memory_read_shared(const APEX_Memory *mem, int address);
 
+void APEX_memory_write_shared(APEX_Memory *mem, int address, int value);
 
+// Data caches
 
+int APEX_cache_init(APEX_CPU *cpu);
 
+int APEX_cache_policy(const char *name);
 
-// IQ - Methods - Array Queue
+const char *APEX_cache_policy_name(int policy);
 
-// int pushIQ();
+int APEX_cache_load(APEX_CPU *cpu, int address);
 
-// int clearIQ(); // can be a general squashing
+int APEX_cache_wait(const APEX_CPU *cpu, int address);
 
-// bool isIQempty();
+void APEX_cache_store(APEX_CPU *cpu, int address);
 
-// bool isIQfull();
+void APEX_cache_reset_stats(APEX_CPU *cpu);
 
-// // ROB Queue - Methods
-// // Cicular Queue
+void APEX_cache_print_stats(const APEX_CPU *cpu);
 
-// int pushROB();
+// Performance counters
 
-// int clearROB(); // can be a general squashing for all cicuclar queues
+int APEX_stats_write(const APEX_CPU *cpu, const char *filename);
 
-// bool isROBempty();
+void APEX_stats_print_units(const APEX_CPU *cpu);
 
-// bool isROBfull();
+APEX_Samples *APEX_samples_open(const APEX_CPU *cpu);
 
-// // LSQ Queue  - Methods
-// //Cicular Queue
+void APEX_samples_take(APEX_CPU *cpu);
 
-// int pushLSQ();
+int APEX_samples_close(APEX_CPU *cpu);
 
-// int clearLSQ(); // can be a general squashing for all cicuclar queues
+// Configuration
 
-// bool isLSQempty();
+void APEX_config_default(APEX_Config *config);
 
-// bool isROBfull();
+int APEX_config_set(APEX_Config *config, const char *key, const char *value);
 
-// // BIS - Methods
-// // Cicular Queue
-// int pushBIS();
+int APEX_config_load(APEX_Config *config, const char *filename);
 
-// int clearBIS(); // can be a general squashing for all cicuclar queues
+int APEX_config_same_shape(const APEX_Config *a, const APEX_Config *b);
 
-// bool isBISempty();
+// Branch prediction
 
-// bool isBISfull();
+int APEX_predictor_kind(const char *name);
 
-// // BTB - Methods
+const char *APEX_predictor_name(int kind);
 
-// int pushBR();
+void APEX_predictor_init(APEX_CPU *cpu);
 
-// int clearBR();
+int APEX_predict(APEX_CPU *cpu, int thread, int pc, int opcode);
 
-// // Common FU's - Methods
+void APEX_predictor_update(APEX_CPU *cpu, int pc, int opcode, uint64_t history,
+                           int taken, int target);
 
-// int flushFu();
+void APEX_predictor_print_stats(const APEX_CPU *cpu);
 
 #endif
@@ -0,0 +1,159 @@
+/*
+ *  functional.c
+ *  Contains the instruction-level interpreter used to fast-forward a
+ *  program before the detailed pipeline takes over
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Memory accesses outside data memory read 0 and write nothing, as they
+ * do in the pipeline
+ */
+static inline int
+load_word(APEX_CPU *cpu, int address)
+{
+  return APEX_memory_read(&cpu->memory, address);
+}
+
+static inline void
+store_word(APEX_CPU *cpu, int address, int value)
+{
+  APEX_memory_write(&cpu->memory, address, value);
+}
+
+/*
+ * Executes up to count instructions, or until pc reaches stop_pc, HALT or
+ * the end of code memory, updating regs[] and data memory directly. HALT
+ * itself is left for the pipeline to retire. Branches train the predictor
+ * and BTB on the way so the detailed run starts warm.
+ *
+ * The pipeline is expected to be empty with the initial identity rename
+ * mapping and a single thread, which is what APEX_cpu_init leaves for
+ * Fastforward. Returns the number of instructions executed.
+ */
+long long APEX_cpu_fast_forward(APEX_CPU *cpu, long long count, int stop_pc)
+{
+  APEX_Thread *th = &cpu->thread[0];
+
+  /* Registers are kept in a local copy so stores to data memory cannot
+   * alias them
+   */
+  int regs[32];
+  int z = cpu->prf[th->rat[Z_FLAG_REG]];
+  int pc = th->pc;
+  long long n = 0;
+
+  memcpy(regs, th->regs, sizeof(regs));
+  for (; n < count && pc != stop_pc; ++n)
+  {
+    unsigned int index = (unsigned)(pc - 4000) / 4;
+    if (pc < 4000 || index >= (unsigned)cpu->code_memory_size)
+    {
+      break;
+    }
+
+    const APEX_Instruction *ins = &cpu->code_memory[index];
+    int next_pc = pc + 4;
+    int taken;
+
+    if (ins->opcode == OP_HALT)
+    {
+      break;
+    }
+
+    switch (ins->opcode)
+    {
+    case OP_MOVC:
+      regs[ins->rd] = ins->imm;
+      break;
+
+    case OP_ADD:
+      z = regs[ins->rd] = regs[ins->rs1] + regs[ins->rs2];
+      break;
+
+    case OP_SUB:
+      z = regs[ins->rd] = regs[ins->rs1] - regs[ins->rs2];
+      break;
+
+    case OP_MUL:
+      z = regs[ins->rd] = regs[ins->rs1] * regs[ins->rs2];
+      break;
+
+    case OP_AND:
+      regs[ins->rd] = regs[ins->rs1] & regs[ins->rs2];
+      break;
+
+    case OP_OR:
+      regs[ins->rd] = regs[ins->rs1] | regs[ins->rs2];
+      break;
+
+    case OP_EXOR:
+      regs[ins->rd] = regs[ins->rs1] ^ regs[ins->rs2];
+      break;
+
+    case OP_ADDL:
+      z = regs[ins->rd] = regs[ins->rs1] + ins->imm;
+      break;
+
+    case OP_SUBL:
+      z = regs[ins->rd] = regs[ins->rs1] - ins->imm;
+      break;
+
+    case OP_LOAD:
+      regs[ins->rd] = load_word(cpu, regs[ins->rs1] + ins->imm);
+      break;
+
+    case OP_LDR:
+      regs[ins->rd] = load_word(cpu, regs[ins->rs1] + regs[ins->rs2]);
+      break;
+
+    case OP_STORE:
+      store_word(cpu, regs[ins->rs2] + ins->imm, regs[ins->rs1]);
+      break;
+
+    case OP_STR:
+      store_word(cpu, regs[ins->rs2] + regs[ins->rs3], regs[ins->rs1]);
+      break;
+
+    case OP_BZ:
+    case OP_BNZ:
+      taken = (z == 0) == (ins->opcode == OP_BZ);
+      APEX_predictor_update(cpu, pc, ins->opcode, cpu->bp.history[0], taken, pc + ins->imm);
+      cpu->bp.history[0] = (cpu->bp.history[0] << 1) | taken;
+      if (taken)
+      {
+        next_pc = pc + ins->imm;
+      }
+      break;
+
+    case OP_JUMP:
+      next_pc = regs[ins->rs1] + ins->imm;
+      APEX_predictor_update(cpu, pc, ins->opcode, cpu->bp.history[0], 1, next_pc);
+      break;
+
+    default:
+      break;
+    }
+    pc = next_pc;
+  }
+
+  /* Hand the architectural state to the physical registers the RAT
+   * points at, and leave the statistics to the detailed run
+   */
+  for (int r = 0; r < ARF; ++r)
+  {
+    cpu->prf[th->rat[r]] = regs[r];
+  }
+  cpu->prf[th->rat[Z_FLAG_REG]] = z;
+  memcpy(th->regs, regs, sizeof(regs));
+  th->pc = pc;
+  APEX_cpu_reset_stats(cpu);
+  return n;
+}
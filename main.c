@@ -7,27 +7,106 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
 
 int main(int argc, char const* argv[])
 {
+  if (argc < 4) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s <input_file> <command> <no_of_cycles> [key=value ...]\n",
+            argv[0]);
+    exit(1);
+  }
 
+  /* Assemble writes the decoded program to the file given in place of
+   * the cycle count
+   */
+  if (strcmp(argv[2], "Assemble") == 0) {
+    int size;
+    uint32_t* lines;
+    APEX_Instruction* code = create_code_memory(argv[1], &size, &lines);
+    if (!code) {
+      exit(1);
+    }
+    int status = APEX_program_write(argv[3], argv[1], code, size, lines);
+    free(code);
+    free(lines);
+    if (status != 0) {
+      exit(1);
+    }
+    printf("(apex) >> Assembled %d instructions into %s\n", size, argv[3]);
+    return 0;
+  }
 
   int no_of_cycles = atoi(argv[3]);
 
-  if (argc != 4) {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
-    exit(1);
+  /* Sweep takes ranges of values, which it expands itself */
+  if (strcmp(argv[2], "Sweep") == 0) {
+    return APEX_sweep_run(argv[1], no_of_cycles, argc - 4, argv + 4) == 0 ? 0 : 1;
   }
 
-  APEX_CPU* cpu = APEX_cpu_init(argv[1], argv[2], no_of_cycles);
+  /* A checkpoint brings its own configuration, which the key=value
+   * arguments then override
+   */
+  APEX_CPU* cpu = NULL;
+  APEX_Config config;
+  if (strcmp(argv[2], "Restore") == 0) {
+    cpu = APEX_cpu_restore(argv[1], no_of_cycles);
+    if (!cpu) {
+      exit(1);
+    }
+    config = cpu->config;
+  } else {
+    APEX_config_default(&config);
+  }
+
+  /* Anything after the cycle count overrides a configuration default */
+  for (int i = 4; i < argc; ++i) {
+    char key[64];
+    const char* eq = strchr(argv[i], '=');
+    if (!eq || eq == argv[i] || (size_t)(eq - argv[i]) >= sizeof(key)) {
+      fprintf(stderr, "APEX_Error : Expected key=value, got '%s'\n", argv[i]);
+      exit(1);
+    }
+    memcpy(key, argv[i], eq - argv[i]);
+    key[eq - argv[i]] = '\0';
+    if (APEX_config_set(&config, key, eq + 1) != 0) {
+      exit(1);
+    }
+  }
+
+  /* Batch takes a directory of programs, or a file listing them, in
+   * place of the input file
+   */
+  if (strcmp(argv[2], "Batch") == 0) {
+    return APEX_batch_run(argv[1], no_of_cycles, &config) == 0 ? 0 : 1;
+  }
+
+  /* Multicore takes one program for every core, or a file listing one
+   * per core
+   */
+  if (strcmp(argv[2], "Multicore") == 0) {
+    return APEX_multicore_run(argv[1], no_of_cycles, &config) == 0 ? 0 : 1;
+  }
+
+  if (cpu) {
+    if (!APEX_config_same_shape(&cpu->config, &config)) {
+      fprintf(stderr, "APEX_Error : Queue sizes, functional units, threads, memory size and "
+                      "cache geometry of a checkpoint cannot be changed\n");
+      exit(1);
+    }
+    cpu->config = config;
+  } else {
+    cpu = APEX_cpu_init(argv[1], argv[2], no_of_cycles, &config);
+  }
   if (!cpu) {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
 
-  APEX_cpu_run(cpu);
+  int status = APEX_cpu_run(cpu);
   APEX_cpu_stop(cpu);
-  return 0;
-}
\ No newline at end of file
+  return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+/*
+ *  memory.c
+ *  Contains the sparse data memory: pages allocated on first write
+ *  behind a two-level page table, with the last page touched cached
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define PAGE_MASK (PAGE_WORDS - 1)
+#define TABLE_ENTRIES (1 << TABLE_BITS)
+
+/* Page number of address, and where its pointer sits in the page table */
+#define PAGE_NUMBER(address) ((unsigned int)(address) >> PAGE_BITS)
+#define DIR_INDEX(number) ((number) >> TABLE_BITS)
+#define TABLE_INDEX(number) ((number) & (TABLE_ENTRIES - 1))
+
+/*
+ * Sets up an empty memory of size words. Nothing is allocated until the
+ * first store.
+ */
+void APEX_memory_init(APEX_Memory *mem, int size)
+{
+  memset(mem, 0, sizeof(*mem));
+  mem->size = size;
+  mem->last_number = -1;
+}
+
+/*
+ * Frees every page of mem
+ */
+void APEX_memory_free(APEX_Memory *mem)
+{
+  for (int d = 0; d < PAGE_DIR_ENTRIES; ++d)
+  {
+    if (mem->dir[d])
+    {
+      for (int t = 0; t < TABLE_ENTRIES; ++t)
+      {
+        free(mem->dir[d][t]);
+      }
+      free(mem->dir[d]);
+    }
+  }
+  memset(mem->dir, 0, sizeof(mem->dir));
+  mem->pages = 0;
+  mem->last_page = NULL;
+  mem->last_number = -1;
+}
+
+/* Page number of mem, or NULL if nothing was ever stored to it */
+static int *
+find_page(const APEX_Memory *mem, unsigned int number)
+{
+  int **table = mem->dir[DIR_INDEX(number)];
+  return table ? table[TABLE_INDEX(number)] : NULL;
+}
+
+/* Page number of mem, allocated zeroed if it does not exist yet */
+static int *
+make_page(APEX_Memory *mem, unsigned int number)
+{
+  int ***table = &mem->dir[DIR_INDEX(number)];
+  if (!*table && !(*table = calloc(TABLE_ENTRIES, sizeof(**table))))
+  {
+    return NULL;
+  }
+  int **page = &(*table)[TABLE_INDEX(number)];
+  if (!*page && (*page = calloc(PAGE_WORDS, sizeof(int))) != NULL)
+  {
+    mem->pages++;
+  }
+  return *page;
+}
+
+/*
+ * Word at address. Words never stored to, and addresses outside the
+ * memory, read as 0.
+ */
+int APEX_memory_read(APEX_Memory *mem, int address)
+{
+  unsigned int number = PAGE_NUMBER(address);
+  if ((int)number != mem->last_number)
+  {
+    int *page = (unsigned int)address < (unsigned int)mem->size ? find_page(mem, number)
+                                                                 : NULL;
+    if (!page)
+    {
+      return 0;
+    }
+    mem->last_page = page;
+    mem->last_number = number;
+  }
+  return mem->last_page[address & PAGE_MASK];
+}
+
+/*
+ * Stores value at address. Stores outside the memory are dropped.
+ */
+void APEX_memory_write(APEX_Memory *mem, int address, int value)
+{
+  unsigned int number = PAGE_NUMBER(address);
+  if ((int)number != mem->last_number)
+  {
+    if ((unsigned int)address >= (unsigned int)mem->size)
+    {
+      return;
+    }
+    int *page = make_page(mem, number);
+    if (!page)
+    {
+      fprintf(stderr, "APEX_Error : Out of memory for data memory page %u\n", number);
+      exit(1);
+    }
+    mem->last_page = page;
+    mem->last_number = number;
+  }
+  mem->last_page[address & PAGE_MASK] = value;
+}
+
+/*
+ * Calls visit(arg, number, page) for every allocated page, in address
+ * order. Stops and returns the first nonzero result of visit.
+ */
+int APEX_memory_pages(const APEX_Memory *mem,
+                      int (*visit)(void *arg, int number, const int *page), void *arg)
+{
+  for (int d = 0; d < PAGE_DIR_ENTRIES; ++d)
+  {
+    for (int t = 0; mem->dir[d] && t < TABLE_ENTRIES; ++t)
+    {
+      int status;
+      if (mem->dir[d][t] && (status = visit(arg, d << TABLE_BITS | t, mem->dir[d][t])) != 0)
+      {
+        return status;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Copies a whole page into mem, as saved by APEX_memory_pages. Returns 0
+ * on success.
+ */
+int APEX_memory_load_page(APEX_Memory *mem, int number, const int *words)
+{
+  if (number < 0 || number >= PAGE_DIR_ENTRIES * TABLE_ENTRIES)
+  {
+    return -1;
+  }
+  int *page = make_page(mem, number);
+  if (!page)
+  {
+    return -1;
+  }
+  memcpy(page, words, sizeof(int) * PAGE_WORDS);
+  return 0;
+}
+
+/*
+ * Word at address of a memory that other threads may be writing. Tables
+ * and pages are installed at most once and never freed while the threads
+ * run, so a reader only has to see their pointers, and the last page is
+ * not cached. Words never stored to read as 0.
+ */
+int APEX_memory_read_shared(const APEX_Memory *mem, int address)
+{
+  if ((unsigned int)address >= (unsigned int)mem->size)
+  {
+    return 0;
+  }
+  unsigned int number = PAGE_NUMBER(address);
+  int **table = __atomic_load_n(&mem->dir[DIR_INDEX(number)], __ATOMIC_ACQUIRE);
+  const int *page = table ? __atomic_load_n(&table[TABLE_INDEX(number)], __ATOMIC_ACQUIRE)
+                          : NULL;
+  return page ? __atomic_load_n(&page[address & PAGE_MASK], __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * Stores value at address of a memory that other threads may be reading
+ * or writing. A missing table or page is allocated and installed with a
+ * compare-and-swap; the thread that loses the race frees its copy and
+ * uses the winner's. Stores outside the memory are dropped.
+ */
+void APEX_memory_write_shared(APEX_Memory *mem, int address, int value)
+{
+  if ((unsigned int)address >= (unsigned int)mem->size)
+  {
+    return;
+  }
+  unsigned int number = PAGE_NUMBER(address);
+
+  int ***dir_slot = &mem->dir[DIR_INDEX(number)];
+  int **table = __atomic_load_n(dir_slot, __ATOMIC_ACQUIRE);
+  if (!table)
+  {
+    int **fresh = calloc(TABLE_ENTRIES, sizeof(*fresh));
+    if (!fresh)
+    {
+      fprintf(stderr, "APEX_Error : Out of memory for data memory page %u\n", number);
+      exit(1);
+    }
+    if (__atomic_compare_exchange_n(dir_slot, &table, fresh, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+    {
+      table = fresh;
+    }
+    else
+    {
+      free(fresh);
+    }
+  }
+
+  int **page_slot = &table[TABLE_INDEX(number)];
+  int *page = __atomic_load_n(page_slot, __ATOMIC_ACQUIRE);
+  if (!page)
+  {
+    int *fresh = calloc(PAGE_WORDS, sizeof(int));
+    if (!fresh)
+    {
+      fprintf(stderr, "APEX_Error : Out of memory for data memory page %u\n", number);
+      exit(1);
+    }
+    if (__atomic_compare_exchange_n(page_slot, &page, fresh, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+    {
+      page = fresh;
+      __atomic_add_fetch(&mem->pages, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+      free(fresh);
+    }
+  }
+  __atomic_store_n(&page[address & PAGE_MASK], value, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,300 @@
+/*
+ *  multicore.c
+ *  Contains the Multicore mode: several cores, each running its own
+ *  program or its own copy of one, sharing one data memory and the
+ *  coherence directory over their caches. Each core is simulated on a
+ *  host thread, and the threads meet at the end of every quantum of
+ *  cycles.
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/* State of a Multicore run, shared by all of its threads */
+typedef struct Multicore_Run
+{
+  APEX_CPU *cores[CORES_MAX];
+  int done[CORES_MAX]; // Core halted, or retired everything up to the end of its code
+  int count;
+  int threads;
+  int no_of_cycles;
+  int quantum;
+  int end;   // Last cycle of the current quantum
+  int quanta;
+  int stop;  // Every core is done, or the cycle budget ran out
+  pthread_barrier_t barrier;
+} Multicore_Run;
+
+typedef struct Multicore_Thread
+{
+  Multicore_Run *run;
+  int id;
+} Multicore_Thread;
+
+/* Ends the run once every core is done or the cycle budget is spent,
+ * else moves on to the next quantum. Called by one thread while the
+ * others wait.
+ */
+static void
+next_quantum(Multicore_Run *run)
+{
+  int active = 0;
+  for (int c = 0; c < run->count; ++c)
+  {
+    active += !run->done[c];
+  }
+  if (!active || (run->no_of_cycles > 0 && run->end >= run->no_of_cycles))
+  {
+    run->stop = 1;
+    return;
+  }
+  run->end += run->quantum;
+  if (run->no_of_cycles > 0 && run->end > run->no_of_cycles)
+  {
+    run->end = run->no_of_cycles;
+  }
+  run->quanta++;
+}
+
+/* Simulates cores id, id + threads, ... one quantum at a time. No core
+ * starts a quantum before every core has finished the one before.
+ */
+static void *
+thread_main(void *arg)
+{
+  Multicore_Thread *thread = arg;
+  Multicore_Run *run = thread->run;
+
+  while (!run->stop)
+  {
+    for (int c = thread->id; c < run->count; c += run->threads)
+    {
+      APEX_CPU *cpu = run->cores[c];
+      if (!run->done[c])
+      {
+        cpu->max_cycles = run->end;
+        APEX_cpu_simulate(cpu);
+        run->done[c] = cpu->halted || cpu->clock <= run->end;
+      }
+    }
+    if (pthread_barrier_wait(&run->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+      next_quantum(run);
+    }
+    pthread_barrier_wait(&run->barrier);
+  }
+  return NULL;
+}
+
+/*
+ * Reads the programs listed one per line in filename into paths.
+ * Returns how many, or -1.
+ */
+static int
+read_list(const char *filename, char *paths[CORES_MAX])
+{
+  FILE *fp = fopen(filename, "r");
+  char *line = NULL;
+  size_t len = 0;
+  int count = 0;
+
+  if (!fp)
+  {
+    return -1;
+  }
+  while (getline(&line, &len, fp) != -1)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!*line)
+    {
+      continue;
+    }
+    if (count == CORES_MAX)
+    {
+      fprintf(stderr, "APEX_Error : %s lists more than %d programs\n", filename, CORES_MAX);
+      count = -1;
+      break;
+    }
+    if (!(paths[count++] = strdup(line)))
+    {
+      count = -1;
+      break;
+    }
+  }
+  free(line);
+  fclose(fp);
+  return count;
+}
+
+static void
+print_results(const Multicore_Run *run, char *const *paths, int programs)
+{
+  long long instructions = 0;
+  int cycles = 0;
+
+  printf("%-4s %-32s %-8s %12s %12s %6s %9s %9s %9s\n", "core", "program", "status",
+         "instructions", "cycles", "IPC", "l1d_miss", "coh_miss", "invalid");
+  for (int c = 0; c < run->count; ++c)
+  {
+    const APEX_CPU *cpu = run->cores[c];
+    int core_cycles = cpu->clock - cpu->start_clock;
+    printf("%-4d %-32s %-8s %12d %12d %6.3f %9u %9u %9u\n", c, paths[c % programs],
+           cpu->halted ? "halted" : "stopped", cpu->ins_completed, core_cycles,
+           core_cycles ? (double)cpu->ins_completed / core_cycles : 0.0,
+           cpu->cache.level[CACHE_L1D].misses, cpu->cache.coherence_misses,
+           cpu->cache.invalidations);
+    instructions += cpu->ins_completed;
+    cycles = core_cycles > cycles ? core_cycles : cycles;
+  }
+  printf("%-4s %-32s %-8s %12lld %12d %6.3f\n", "all", "", "", instructions, cycles,
+         cycles ? (double)instructions / cycles : 0.0);
+}
+
+/*
+ * Simulates config->cores cores for up to no_of_cycles cycles (0 until
+ * every core halts). source is one program that every core runs, or a
+ * file listing one program per line that the cores take in turn, one
+ * core per program when config->cores is 0. Register core_reg of each
+ * hardware thread starts out holding core * smt_threads + thread. The
+ * cores share one data memory of memory_words words, and with an L1D
+ * configured their caches are kept coherent: a store invalidates the
+ * copies of every other core. Cores
+ * are dealt out over config->threads host threads, which synchronise
+ * every quantum cycles. Within a quantum the order in which cores on
+ * different threads see each other's stores depends on the host, so
+ * only threads=1 repeats a racy program exactly. Per-cycle output and
+ * the checkpoint, trace, stats and samples files are turned off.
+ * Returns 0 if every core could be loaded.
+ */
+int APEX_multicore_run(const char *source, int no_of_cycles, const APEX_Config *config)
+{
+  char *paths[CORES_MAX];
+  int programs;
+  int status = 0;
+
+  if (APEX_program_is_binary(source) ||
+      (strlen(source) > 4 && strcmp(source + strlen(source) - 4, ".asm") == 0))
+  {
+    paths[0] = strdup(source);
+    programs = paths[0] ? 1 : -1;
+  }
+  else
+  {
+    programs = read_list(source, paths);
+  }
+  if (programs <= 0)
+  {
+    fprintf(stderr, "APEX_Error : No programs found in %s\n", source);
+    for (int p = 0; p < programs; ++p)
+    {
+      free(paths[p]);
+    }
+    return -1;
+  }
+
+  APEX_Config core_config = *config;
+  core_config.verbose = 0;
+  core_config.checkpoint[0] = '\0';
+  core_config.trace[0] = '\0';
+  core_config.stats[0] = '\0';
+  core_config.samples[0] = '\0';
+
+  Multicore_Run *run = calloc(1, sizeof(*run));
+  APEX_Shared *shared = calloc(1, sizeof(*shared));
+  if (!run || !shared)
+  {
+    fprintf(stderr, "APEX_Error : Out of memory setting up the cores\n");
+    exit(1);
+  }
+  APEX_memory_init(&shared->memory, config->memory_words);
+
+  run->count = config->cores ? config->cores : programs;
+  for (int c = 0; c < run->count && status == 0; ++c)
+  {
+    APEX_CPU *cpu = APEX_cpu_init(paths[c % programs], "Simulate", 0, &core_config);
+    if (!cpu)
+    {
+      fprintf(stderr, "APEX_Error : Unable to initialize core %d\n", c);
+      status = -1;
+      break;
+    }
+    cpu->shared = shared;
+    cpu->core = c;
+    for (int t = 0; t < config->smt_threads; ++t)
+    {
+      APEX_Thread *th = &cpu->thread[t];
+      th->regs[config->core_reg] = c * config->smt_threads + t;
+      cpu->prf[th->rat[config->core_reg]] = th->regs[config->core_reg];
+    }
+    run->cores[c] = cpu;
+  }
+
+  if (status == 0)
+  {
+    run->threads = config->threads ? config->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (run->threads > run->count)
+    {
+      run->threads = run->count;
+    }
+    if (run->threads < 1)
+    {
+      run->threads = 1;
+    }
+    run->no_of_cycles = no_of_cycles;
+    run->quantum = config->quantum;
+    run->end = no_of_cycles > 0 && no_of_cycles < run->quantum ? no_of_cycles : run->quantum;
+    run->quanta = 1;
+
+    Multicore_Thread threads[CORES_MAX];
+    pthread_t handles[CORES_MAX];
+    struct timespec start, end;
+    pthread_barrier_init(&run->barrier, NULL, run->threads);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < run->threads; ++t)
+    {
+      threads[t].run = run;
+      threads[t].id = t;
+      if (pthread_create(&handles[t], NULL, thread_main, &threads[t]) != 0)
+      {
+        fprintf(stderr, "APEX_Error : Unable to start worker thread\n");
+        exit(1);
+      }
+    }
+    for (int t = 0; t < run->threads; ++t)
+    {
+      pthread_join(handles[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&run->barrier);
+
+    print_results(run, paths, programs);
+    printf("(apex) >> %d cores on %d threads, %d quanta of %d cycles in %.3f s\n",
+           run->count, run->threads, run->quanta, run->quantum,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+
+  for (int c = 0; c < run->count; ++c)
+  {
+    if (run->cores[c])
+    {
+      APEX_cpu_stop(run->cores[c]);
+    }
+  }
+  for (int p = 0; p < programs; ++p)
+  {
+    free(paths[p]);
+  }
+  APEX_memory_free(&shared->memory);
+  free(shared);
+  free(run);
+  return status;
+}
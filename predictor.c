@@ -0,0 +1,371 @@
+/*
+ *  predictor.c
+ *  Contains the branch direction predictors and the branch target buffer
+ *  consulted by fetch and trained by branch_fu
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define MASK(bits) ((1u << (bits)) - 1)
+
+/* History bits used by each tagged TAGE component, shortest first */
+static const int tage_history[TAGE_TABLES] = {4, 9, 19, 40};
+
+/*
+ * A direction predictor. predict sees the BTB target, or -1 on a BTB
+ * miss, and the global history before the branch; update gets the same
+ * history back once the branch resolves.
+ */
+typedef struct Predictor_Ops
+{
+  const char *name;
+  int (*predict)(const APEX_CPU *cpu, int pc, uint64_t history, int target);
+  void (*update)(APEX_CPU *cpu, int pc, uint64_t history, int taken);
+} Predictor_Ops;
+
+/* Saturating 2-bit counter update */
+static inline void
+counter_update(uint8_t *ctr, int taken)
+{
+  if (taken && *ctr < 3)
+  {
+    (*ctr)++;
+  }
+  else if (!taken && *ctr > 0)
+  {
+    (*ctr)--;
+  }
+}
+
+static inline unsigned int
+bimodal_index(const APEX_CPU *cpu, int pc)
+{
+  return (pc >> 2) & MASK(cpu->config.pht_bits);
+}
+
+static inline unsigned int
+gshare_index(const APEX_CPU *cpu, int pc, uint64_t history)
+{
+  return ((pc >> 2) ^ (unsigned int)history) & MASK(cpu->config.pht_bits);
+}
+
+/* Folds the newest length bits of history down to bits bits */
+static unsigned int
+fold_history(uint64_t history, int length, int bits)
+{
+  unsigned int folded = 0;
+  if (length < 64)
+  {
+    history &= (1ull << length) - 1;
+  }
+  for (; length > 0; length -= bits)
+  {
+    folded ^= history & MASK(bits);
+    history >>= bits;
+  }
+  return folded;
+}
+
+static inline unsigned int
+tage_index(int t, int pc, uint64_t history)
+{
+  return ((pc >> 2) ^ ((pc >> 2) >> (TAGE_BITS - t)) ^
+          fold_history(history, tage_history[t], TAGE_BITS)) &
+         MASK(TAGE_BITS);
+}
+
+static inline uint8_t
+tage_tag(int t, int pc, uint64_t history)
+{
+  return ((pc >> 2) ^ fold_history(history, tage_history[t], 8) ^
+          (fold_history(history, tage_history[t], 7) << 1)) &
+         0xFF;
+}
+
+/* Longest component whose tag matches, or -1 when only the base does */
+static int
+tage_provider(const APEX_CPU *cpu, int pc, uint64_t history, int below)
+{
+  for (int t = below - 1; t >= 0; --t)
+  {
+    const TAGE_Entry *entry = &cpu->bp.tage[t][tage_index(t, pc, history)];
+    if (entry->tag == tage_tag(t, pc, history))
+    {
+      return t;
+    }
+  }
+  return -1;
+}
+
+/* Prediction of component t, -1 being the bimodal base */
+static int
+tage_component_predict(const APEX_CPU *cpu, int t, int pc, uint64_t history)
+{
+  if (t < 0)
+  {
+    return cpu->bp.pht[bimodal_index(cpu, pc)] >= 2;
+  }
+  return cpu->bp.tage[t][tage_index(t, pc, history)].ctr >= 0;
+}
+
+static int
+static_predict(const APEX_CPU *cpu, int pc, uint64_t history, int target)
+{
+  return target >= 0 && target < pc;
+}
+
+static void
+static_update(APEX_CPU *cpu, int pc, uint64_t history, int taken)
+{
+}
+
+static int
+bimodal_predict(const APEX_CPU *cpu, int pc, uint64_t history, int target)
+{
+  return cpu->bp.pht[bimodal_index(cpu, pc)] >= 2;
+}
+
+static void
+bimodal_update(APEX_CPU *cpu, int pc, uint64_t history, int taken)
+{
+  counter_update(&cpu->bp.pht[bimodal_index(cpu, pc)], taken);
+}
+
+static int
+gshare_predict(const APEX_CPU *cpu, int pc, uint64_t history, int target)
+{
+  return cpu->bp.pht[gshare_index(cpu, pc, history)] >= 2;
+}
+
+static void
+gshare_update(APEX_CPU *cpu, int pc, uint64_t history, int taken)
+{
+  counter_update(&cpu->bp.pht[gshare_index(cpu, pc, history)], taken);
+}
+
+static int
+tage_predict(const APEX_CPU *cpu, int pc, uint64_t history, int target)
+{
+  int provider = tage_provider(cpu, pc, history, TAGE_TABLES);
+  return tage_component_predict(cpu, provider, pc, history);
+}
+
+/*
+ * The provider's counter learns the outcome and its usefulness follows
+ * whether it beat the alternate prediction. A misprediction allocates an
+ * entry in one longer component whose usefulness has run out, or ages
+ * all of them when none has.
+ */
+static void
+tage_update(APEX_CPU *cpu, int pc, uint64_t history, int taken)
+{
+  int provider = tage_provider(cpu, pc, history, TAGE_TABLES);
+  int predicted = tage_component_predict(cpu, provider, pc, history);
+
+  if (provider < 0)
+  {
+    counter_update(&cpu->bp.pht[bimodal_index(cpu, pc)], taken);
+  }
+  else
+  {
+    TAGE_Entry *entry = &cpu->bp.tage[provider][tage_index(provider, pc, history)];
+    int alternate = tage_component_predict(
+        cpu, tage_provider(cpu, pc, history, provider), pc, history);
+
+    if (alternate != predicted)
+    {
+      if (predicted == taken && entry->u < 3)
+      {
+        entry->u++;
+      }
+      else if (predicted != taken && entry->u > 0)
+      {
+        entry->u--;
+      }
+    }
+    if (taken && entry->ctr < 3)
+    {
+      entry->ctr++;
+    }
+    else if (!taken && entry->ctr > -4)
+    {
+      entry->ctr--;
+    }
+  }
+
+  if (predicted != taken)
+  {
+    int allocated = 0;
+    for (int t = provider + 1; t < TAGE_TABLES && !allocated; ++t)
+    {
+      TAGE_Entry *entry = &cpu->bp.tage[t][tage_index(t, pc, history)];
+      if (entry->u == 0)
+      {
+        entry->tag = tage_tag(t, pc, history);
+        entry->ctr = taken ? 0 : -1;
+        allocated = 1;
+      }
+    }
+    for (int t = provider + 1; t < TAGE_TABLES && !allocated; ++t)
+    {
+      TAGE_Entry *entry = &cpu->bp.tage[t][tage_index(t, pc, history)];
+      if (entry->u > 0)
+      {
+        entry->u--;
+      }
+    }
+  }
+}
+
+static const Predictor_Ops predictors[NUM_PREDICTORS] = {
+    [PRED_STATIC] = {"static", static_predict, static_update},
+    [PRED_BIMODAL] = {"bimodal", bimodal_predict, bimodal_update},
+    [PRED_GSHARE] = {"gshare", gshare_predict, gshare_update},
+    [PRED_TAGE] = {"tage", tage_predict, tage_update},
+};
+
+/*
+ * Returns the predictor called name, or -1 if there is none
+ */
+int APEX_predictor_kind(const char *name)
+{
+  for (int kind = 0; kind < NUM_PREDICTORS; ++kind)
+  {
+    if (strcmp(name, predictors[kind].name) == 0)
+    {
+      return kind;
+    }
+  }
+  return -1;
+}
+
+const char *APEX_predictor_name(int kind)
+{
+  return predictors[kind].name;
+}
+
+/*
+ * Counters start weakly not taken, the BTB and TAGE components empty
+ */
+void APEX_predictor_init(APEX_CPU *cpu)
+{
+  memset(&cpu->bp, 0, sizeof(cpu->bp));
+  memset(cpu->bp.pht, 1, sizeof(cpu->bp.pht));
+}
+
+/* BTB way holding pc, or NULL */
+static BTB_Entry *
+btb_lookup(APEX_CPU *cpu, int pc)
+{
+  int set = (pc >> 2) & (cpu->config.btb_sets - 1);
+  BTB_Entry *ways = &cpu->bp.btb[set * cpu->config.btb_ways];
+  for (int w = 0; w < cpu->config.btb_ways; ++w)
+  {
+    if (ways[w].pc == pc)
+    {
+      return &ways[w];
+    }
+  }
+  return NULL;
+}
+
+/* Records a taken target, replacing the least recently used way */
+static void
+btb_insert(APEX_CPU *cpu, int pc, int target)
+{
+  BTB_Entry *entry = btb_lookup(cpu, pc);
+  if (!entry)
+  {
+    int set = (pc >> 2) & (cpu->config.btb_sets - 1);
+    BTB_Entry *ways = &cpu->bp.btb[set * cpu->config.btb_ways];
+    entry = &ways[0];
+    for (int w = 1; w < cpu->config.btb_ways; ++w)
+    {
+      if (ways[w].used < entry->used)
+      {
+        entry = &ways[w];
+      }
+    }
+    entry->pc = pc;
+  }
+  entry->target = target;
+  entry->used = ++cpu->bp.btb_tick;
+}
+
+/*
+ * Address for thread to fetch after the instruction at pc. Only control
+ * instructions consult the BTB; a conditional branch also shifts its
+ * predicted direction into the global history of the thread.
+ */
+int APEX_predict(APEX_CPU *cpu, int thread, int pc, int opcode)
+{
+  if (apex_opcode_info[opcode].fu != FU_BR)
+  {
+    return pc + 4;
+  }
+
+  BTB_Entry *entry = btb_lookup(cpu, pc);
+  int target = -1;
+
+  cpu->bp.btb_lookups++;
+  if (entry)
+  {
+    cpu->bp.btb_hits++;
+    entry->used = ++cpu->bp.btb_tick;
+    target = entry->target;
+  }
+
+  if (opcode == OP_JUMP)
+  {
+    return target >= 0 ? target : pc + 4;
+  }
+
+  int taken = target >= 0 &&
+              predictors[cpu->config.predictor].predict(cpu, pc, cpu->bp.history[thread],
+                                                        target);
+  cpu->bp.history[thread] = (cpu->bp.history[thread] << 1) | taken;
+  return taken ? target : pc + 4;
+}
+
+/*
+ * Trains the BTB and the direction predictor with a resolved branch.
+ * history is the global history the branch was predicted with.
+ */
+void APEX_predictor_update(APEX_CPU *cpu, int pc, int opcode, uint64_t history,
+                           int taken, int target)
+{
+  cpu->bp.branches++;
+  if (taken)
+  {
+    btb_insert(cpu, pc, target);
+  }
+  if (opcode != OP_JUMP)
+  {
+    predictors[cpu->config.predictor].update(cpu, pc, history, taken);
+  }
+}
+
+void APEX_predictor_print_stats(const APEX_CPU *cpu)
+{
+  const APEX_Predictor *bp = &cpu->bp;
+  if (!bp->branches)
+  {
+    return;
+  }
+  printf("(apex) >> %s: %u branches, %.2f%% predicted, %u mispredicts "
+         "(%u cycles, %u instructions squashed)\n",
+         APEX_predictor_name(cpu->config.predictor), bp->branches,
+         100.0 * (bp->branches - bp->mispredicts) / bp->branches,
+         bp->mispredicts, bp->penalty_cycles, bp->squashed);
+  printf("(apex) >> BTB %dx%d: %.2f%% hit rate over %u lookups\n",
+         cpu->config.btb_sets, cpu->config.btb_ways,
+         bp->btb_lookups ? 100.0 * bp->btb_hits / bp->btb_lookups : 0.0,
+         bp->btb_lookups);
+}
@@ -0,0 +1,181 @@
+/*
+ *  program.c
+ *  Contains the pre-assembled binary program format: writing it from
+ *  decoded code memory, and mapping it back as code memory
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+static const char program_magic[8] = "APEXPROG";
+
+/*
+ * Program file layout, all in host byte order:
+ *
+ *   header
+ *   APEX_Instruction[count]  code memory, used in place once mapped
+ *   uint32_t[count]          source line of each instruction
+ *   char[source_length]      source file name, not NUL terminated
+ */
+typedef struct Program_Header
+{
+  char magic[8];
+  uint32_t version;           // APEX_PROGRAM_VERSION
+  uint32_t instruction_size;  // sizeof(APEX_Instruction) of the assembler
+  uint32_t count;             // Instructions
+  uint32_t source_length;     // Bytes of source file name
+  uint8_t pad[8];
+} Program_Header;
+
+_Static_assert(sizeof(Program_Header) % sizeof(uint32_t) == 0,
+               "program sections must stay aligned");
+
+/*
+ * Returns 1 if filename holds a binary program rather than assembly text
+ */
+int APEX_program_is_binary(const char *filename)
+{
+  char magic[sizeof(program_magic)];
+  FILE *fp = fopen(filename, "rb");
+  if (!fp)
+  {
+    return 0;
+  }
+  int binary = fread(magic, sizeof(magic), 1, fp) == 1 &&
+               memcmp(magic, program_magic, sizeof(magic)) == 0;
+  fclose(fp);
+  return binary;
+}
+
+/*
+ * Writes size instructions of decoded code memory to filename. lines
+ * gives the source line of each instruction, or NULL when instruction i
+ * came from line i + 1. Returns 0 on success.
+ */
+int APEX_program_write(const char *filename, const char *source,
+                       const APEX_Instruction *code_memory, int size,
+                       const uint32_t *lines)
+{
+  Program_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, program_magic, sizeof(header.magic));
+  header.version = APEX_PROGRAM_VERSION;
+  header.instruction_size = sizeof(APEX_Instruction);
+  header.count = size;
+  header.source_length = strlen(source);
+
+  FILE *fp = fopen(filename, "wb");
+  if (!fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    return -1;
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(code_memory, sizeof(*code_memory), size, fp) == (size_t)size;
+  for (int i = 0; ok && i < size; ++i)
+  {
+    uint32_t line = lines ? lines[i] : (uint32_t)i + 1;
+    ok = fwrite(&line, sizeof(line), 1, fp) == 1;
+  }
+  ok = ok && fwrite(source, 1, header.source_length, fp) == header.source_length;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns 1 if ins has a known opcode, the operand format of that
+ * opcode and register fields inside the ARF
+ */
+static int
+valid_instruction(const APEX_Instruction *ins)
+{
+  return ins->opcode < NUM_OPCODES && ins->format == apex_opcode_info[ins->opcode].format &&
+         ins->rd < ARF && ins->rs1 < ARF && ins->rs2 < ARF && ins->rs3 < ARF;
+}
+
+/*
+ * Maps the binary program in filename and returns its code memory in
+ * place. mapped receives the length of the mapping, to be handed back to
+ * APEX_program_unmap. Returns NULL if the program is malformed or was
+ * assembled for a different instruction layout.
+ */
+APEX_Instruction *
+APEX_program_map(const char *filename, int *size, size_t *mapped)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Program_Header))
+  {
+    fprintf(stderr, "APEX_Error : %s is truncated\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  const Program_Header *header = (const Program_Header *)map;
+  if (memcmp(header->magic, program_magic, sizeof(header->magic)) != 0 ||
+      header->version != APEX_PROGRAM_VERSION ||
+      header->instruction_size != sizeof(APEX_Instruction) ||
+      header->count == 0 || header->count > INT32_MAX / sizeof(APEX_Instruction) ||
+      (size_t)st.st_size != sizeof(*header) +
+                                (size_t)header->count *
+                                    (sizeof(APEX_Instruction) + sizeof(uint32_t)) +
+                                header->source_length)
+  {
+    fprintf(stderr, "APEX_Error : %s is not a program for this version of the simulator\n",
+            filename);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  /* The pipeline indexes register files and opcode tables with these
+   * fields unchecked, so every record must be one the assembler could
+   * have produced
+   */
+  const APEX_Instruction *code = (const APEX_Instruction *)(map + sizeof(*header));
+  for (uint32_t i = 0; i < header->count; ++i)
+  {
+    if (!valid_instruction(&code[i]))
+    {
+      fprintf(stderr, "APEX_Error : %s has a malformed instruction at pc(%u)\n", filename,
+              4000 + 4 * i);
+      munmap(map, st.st_size);
+      return NULL;
+    }
+  }
+
+  *size = header->count;
+  *mapped = st.st_size;
+  return (APEX_Instruction *)(map + sizeof(*header));
+}
+
+void APEX_program_unmap(APEX_Instruction *code_memory, size_t mapped)
+{
+  munmap((char *)code_memory - sizeof(Program_Header), mapped);
+}
@@ -0,0 +1,492 @@
+/*
+ *  stats.c
+ *  Contains the report of the performance counters: IPC, the CPI stack,
+ *  stall causes, stage and queue occupancy, functional unit port use and
+ *  per-opcode latencies, as JSON, and the interval samples of them taken
+ *  every N cycles
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const char *const cpi_names[NUM_CPI] = {
+    [CPI_BASE] = "base",         [CPI_FRONTEND] = "frontend", [CPI_BRANCH] = "branch",
+    [CPI_EXECUTE] = "execute",   [CPI_MULTIPLY] = "multiply", [CPI_MEMORY] = "memory"};
+
+static const char *const stage_names[NUM_STAGES] = {
+    [F] = "fetch", [DRD] = "decode", [MEM] = "memory"};
+
+static const char *const fu_names[NUM_FU_CLASSES] = {
+    [FU_INT] = "int", [FU_MUL] = "mul", [FU_BR] = "br"};
+
+static const char *const cache_names[NUM_CACHE_LEVELS] = {
+    [CACHE_L1D] = "l1d", [CACHE_L2] = "l2"};
+
+static const char *const width_names[NUM_WIDTHS] = {
+    [WIDTH_FETCH] = "fetch", [WIDTH_DECODE] = "decode", [WIDTH_ISSUE] = "issue",
+    [WIDTH_COMMIT] = "commit"};
+
+/* sum / count, or 0 when there is nothing to average over */
+static double
+ratio(uint64_t sum, uint64_t count)
+{
+  return count ? (double)sum / count : 0.0;
+}
+
+/* Share of the cycles unit u of cpu->fu could not take a new
+ * instruction because of the ones issued to it: one cycle each for a
+ * pipelined unit, its whole latency for an unpipelined one
+ */
+static double
+port_use(const APEX_CPU *cpu, int u)
+{
+  const APEX_FU *fu = &cpu->fu[u];
+  int cycles = cpu->config.fu_pipelined[fu->fu] ? 1 : fu->latency;
+  return ratio(cpu->stats.fu_issued[u] * cycles, cpu->clock - cpu->start_clock);
+}
+
+static void
+write_json(const APEX_CPU *cpu, FILE *fp)
+{
+  const APEX_Stats *stats = &cpu->stats;
+  uint64_t cycles = cpu->clock - cpu->start_clock;
+  uint64_t instructions = cpu->ins_completed;
+  uint64_t slots = cycles * cpu->config.commit_width;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"cycles\": %llu,\n", (unsigned long long)cycles);
+  fprintf(fp, "  \"instructions\": %llu,\n", (unsigned long long)instructions);
+  fprintf(fp, "  \"ipc\": %.4f,\n", ratio(instructions, cycles));
+  fprintf(fp, "  \"cpi\": %.4f,\n", ratio(cycles, instructions));
+
+  /* Each component is its share of the commit slots, scaled to CPI */
+  fprintf(fp, "  \"cpi_stack\": {");
+  for (int c = 0; c < NUM_CPI; ++c)
+  {
+    fprintf(fp, "%s\n    \"%s\": %.4f", c ? "," : "", cpi_names[c],
+            ratio(stats->cpi[c], slots) * ratio(cycles, instructions));
+  }
+  fprintf(fp, "\n  },\n");
+
+  fprintf(fp, "  \"stall_cycles\": {\n");
+  fprintf(fp, "    \"rob_full\": %u,\n", cpu->stalls[STALL_ROB]);
+  fprintf(fp, "    \"iq_full\": %u,\n", cpu->stalls[STALL_IQ]);
+  fprintf(fp, "    \"lsq_full\": %u,\n", cpu->stalls[STALL_LSQ]);
+  fprintf(fp, "    \"no_free_prf\": %u,\n", cpu->stalls[STALL_PRF]);
+  fprintf(fp, "    \"bis_full\": %u,\n", cpu->stalls[STALL_BIS]);
+  fprintf(fp, "    \"branch_flush\": %u,\n", cpu->bp.penalty_cycles);
+  fprintf(fp, "    \"fu_busy\": {");
+  for (int fu = FU_INT; fu <= FU_BR; ++fu)
+  {
+    fprintf(fp, "%s \"%s\": %llu", fu > FU_INT ? "," : "", fu_names[fu],
+            (unsigned long long)stats->fu_busy[fu]);
+  }
+  fprintf(fp, " }\n  },\n");
+
+  fprintf(fp, "  \"branches\": { \"resolved\": %u, \"mispredicts\": %u, \"squashed\": %u },\n",
+          cpu->bp.branches, cpu->bp.mispredicts, cpu->bp.squashed);
+  fprintf(fp, "  \"memory\": { \"words\": %d, \"pages\": %d, \"out_of_range\": %u },\n",
+          cpu->memory.size, cpu->memory.pages, cpu->memory.out_of_range);
+
+  /* Writebacks from the level above count as accesses of a level */
+  fprintf(fp, "  \"caches\": {");
+  for (int l = 0; l < cpu->cache.levels; ++l)
+  {
+    const Cache_Level *level = &cpu->cache.level[l];
+    fprintf(fp, "\n    \"%s\": { \"sets\": %d, \"ways\": %d, \"line\": %d, "
+                "\"accesses\": %u, \"misses\": %u, \"hit_rate\": %.4f, "
+                "\"writebacks\": %u },",
+            cache_names[l], level->sets, level->ways, 1 << level->line_shift,
+            level->accesses, level->misses,
+            ratio(level->accesses - level->misses, level->accesses), level->writebacks);
+  }
+  fprintf(fp, "\n    \"mshr_merged\": %u,\n    \"mshr_full\": %u\n  },\n",
+          cpu->cache.merged, cpu->cache.mshr_stalls);
+  fprintf(fp, "  \"uop_cache\": { \"entries\": %d, \"lookups\": %u, \"hits\": %u, "
+              "\"hit_rate\": %.4f, \"streamed\": %u },\n",
+          cpu->config.uop_cache, cpu->uop.lookups, cpu->uop.hits,
+          ratio(cpu->uop.hits, cpu->uop.lookups), cpu->uop.streamed);
+  fprintf(fp, "  \"smt\": { \"threads\": %d, \"fetch_policy\": \"%s\", \"retired\": [",
+          cpu->config.smt_threads, APEX_fetch_policy_name(cpu->config.fetch_policy));
+  for (int t = 0; t < cpu->config.smt_threads; ++t)
+  {
+    fprintf(fp, "%s%d", t ? ", " : "", cpu->thread[t].ins_completed);
+  }
+  fprintf(fp, "] },\n");
+
+  /* Cycles each stage handled 0, 1, ... up to its width instructions */
+  const int widths[NUM_WIDTHS] = {
+      [WIDTH_FETCH] = cpu->config.fetch_width, [WIDTH_DECODE] = cpu->config.decode_width,
+      [WIDTH_ISSUE] = cpu->config.issue_width, [WIDTH_COMMIT] = cpu->config.commit_width};
+  fprintf(fp, "  \"widths\": {");
+  for (int w = 0; w < NUM_WIDTHS; ++w)
+  {
+    int bins = widths[w] < WIDTH_BINS ? widths[w] + 1 : WIDTH_BINS;
+    fprintf(fp, "%s\n    \"%s\": { \"width\": %d, \"cycles\": [", w ? "," : "",
+            width_names[w], widths[w]);
+    for (int b = 0; b < bins; ++b)
+    {
+      fprintf(fp, "%s%llu", b ? ", " : "", (unsigned long long)stats->width[w][b]);
+    }
+    fprintf(fp, "] }");
+  }
+  fprintf(fp, "\n  },\n");
+
+  /* Average instructions held per cycle */
+  fprintf(fp, "  \"occupancy\": {\n");
+  for (int s = 0; s < NUM_STAGES; ++s)
+  {
+    fprintf(fp, "    \"%s\": %.4f,\n", stage_names[s], ratio(stats->occupancy[s], cycles));
+  }
+  fprintf(fp, "    \"iq\": %.4f,\n", ratio(stats->iq, cycles));
+  fprintf(fp, "    \"rob\": %.4f,\n", ratio(stats->rob, cycles));
+  fprintf(fp, "    \"lsq\": %.4f,\n", ratio(stats->lsq, cycles));
+  fprintf(fp, "    \"prf\": %.4f,\n", ratio(stats->prf, cycles));
+  fprintf(fp, "    \"functional_units\": [");
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    const APEX_FU *fu = &cpu->fu[u];
+    fprintf(fp, "%s\n      { \"class\": \"%s\", \"unit\": %d, \"latency\": %d, "
+                "\"occupancy\": %.4f }",
+            u ? "," : "", fu_names[fu->fu], fu->unit, fu->latency,
+            ratio(stats->fu_occupancy[u], cycles));
+  }
+  fprintf(fp, "\n    ]\n  },\n");
+
+  fprintf(fp, "  \"ports\": [");
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    const APEX_FU *fu = &cpu->fu[u];
+    fprintf(fp, "%s\n    { \"class\": \"%s\", \"unit\": %d, \"latency\": %d, "
+                "\"pipelined\": %d, \"issued\": %llu, \"utilization\": %.4f }",
+            u ? "," : "", fu_names[fu->fu], fu->unit, fu->latency,
+            cpu->config.fu_pipelined[fu->fu], (unsigned long long)stats->fu_issued[u],
+            port_use(cpu, u));
+  }
+  fprintf(fp, "\n  ],\n");
+
+  /* Dispatch-to-retire latency of every opcode that retired */
+  fprintf(fp, "  \"opcodes\": {");
+  for (int op = 0, first = 1; op < NUM_OPCODES; ++op)
+  {
+    if (stats->opcode_count[op])
+    {
+      fprintf(fp, "%s\n    \"%s\": { \"count\": %llu, \"latency\": %.4f }", first ? "" : ",",
+              apex_opcode_info[op].name, (unsigned long long)stats->opcode_count[op],
+              ratio(stats->opcode_latency[op], stats->opcode_count[op]));
+      first = 0;
+    }
+  }
+  fprintf(fp, "\n  }\n}\n");
+}
+
+/*
+ * Prints the functional unit pool with how busy each issue port was
+ */
+void APEX_stats_print_units(const APEX_CPU *cpu)
+{
+  printf("(apex) >> Units:");
+  for (int u = 0; u < cpu->num_fus; ++u)
+  {
+    const APEX_FU *fu = &cpu->fu[u];
+    printf("%s %s%d %d-stage%s %.1f%%", u ? "," : "", fu_names[fu->fu], fu->unit,
+           fu->latency, cpu->config.fu_pipelined[fu->fu] ? "" : " unpipelined",
+           100.0 * port_use(cpu, u));
+  }
+  printf("\n");
+}
+
+/*
+ * Writes the counters of cpu to filename as JSON, or to stdout when
+ * filename is -. Returns 0 on success.
+ */
+int APEX_stats_write(const APEX_CPU *cpu, const char *filename)
+{
+  if (strcmp(filename, "-") == 0)
+  {
+    write_json(cpu, stdout);
+    return 0;
+  }
+
+  FILE *fp = fopen(filename, "w");
+  if (!fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    return -1;
+  }
+  write_json(cpu, fp);
+  if (fclose(fp) != 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+static const char samples_magic[8] = "APEXSMPL";
+
+/* Cumulative counters at the start of a cycle */
+typedef struct Sample
+{
+  uint64_t clock;
+  uint64_t instructions;
+  uint64_t branches;
+  uint64_t mispredicts;
+  uint64_t mem_ops;
+  uint64_t stalls;
+  uint64_t iq;
+  uint64_t rob;
+  uint64_t lsq;
+  uint64_t prf;
+} Sample;
+
+/* Columns of a sample file, each row covering one interval */
+enum Sample_Column
+{
+  COL_CYCLE,        // Cycle the interval ends before
+  COL_CYCLES,       // Length of the interval
+  COL_INSTRUCTIONS, // Retired in the interval
+  COL_IPC,
+  COL_IQ,           // Average occupancy over the interval
+  COL_ROB,
+  COL_LSQ,
+  COL_PRF,
+  COL_BRANCHES,     // Resolved in the interval
+  COL_MISPREDICTS,
+  COL_MEM_OPS,      // Loads and stores retired in the interval
+  COL_STALLS,       // Cycles decode could not dispatch, any reason
+  NUM_COLUMNS
+};
+
+static const char *const column_names[NUM_COLUMNS] = {
+    [COL_CYCLE] = "cycle",       [COL_CYCLES] = "cycles",
+    [COL_INSTRUCTIONS] = "instructions", [COL_IPC] = "ipc",
+    [COL_IQ] = "iq",             [COL_ROB] = "rob",
+    [COL_LSQ] = "lsq",           [COL_PRF] = "prf",
+    [COL_BRANCHES] = "branches", [COL_MISPREDICTS] = "mispredicts",
+    [COL_MEM_OPS] = "mem_ops",   [COL_STALLS] = "stalls"};
+
+/*
+ * Binary sample file layout, all in host byte order:
+ *
+ *   header
+ *   char[columns][16]      column names, NUL padded
+ *   double[columns][rows]  values, one column after another
+ */
+typedef struct Samples_Header
+{
+  char magic[8];
+  uint32_t version; // APEX_SAMPLES_VERSION
+  uint32_t columns;
+  uint64_t rows;
+} Samples_Header;
+
+/* Samples of one run, kept in memory until it ends. A sample costs a
+ * few dozen bytes every interval cycles, so even short intervals over
+ * long runs stay small.
+ */
+struct APEX_Samples
+{
+  FILE *fp;
+  int csv;       // File name ends in .csv, else binary
+  int failed;    // Out of memory, the samples are incomplete
+  Sample *rows;  // rows[0] is where the run started
+  int count;
+  int capacity;
+};
+
+/* Takes the counters of cpu as sample row */
+static void
+snapshot(const APEX_CPU *cpu, Sample *row)
+{
+  const APEX_Stats *stats = &cpu->stats;
+  row->clock = cpu->clock;
+  row->instructions = cpu->ins_completed;
+  row->branches = cpu->bp.branches;
+  row->mispredicts = cpu->bp.mispredicts;
+  row->mem_ops = 0;
+  for (int op = 0; op < NUM_OPCODES; ++op)
+  {
+    if (apex_opcode_info[op].fu == FU_MEM)
+    {
+      row->mem_ops += stats->opcode_count[op];
+    }
+  }
+  row->stalls = 0;
+  for (int s = STALL_NONE + 1; s < NUM_STALLS; ++s)
+  {
+    row->stalls += cpu->stalls[s];
+  }
+  row->iq = stats->iq;
+  row->rob = stats->rob;
+  row->lsq = stats->lsq;
+  row->prf = stats->prf;
+}
+
+/* Values of the interval between rows a and b */
+static void
+interval_values(const Sample *a, const Sample *b, double values[NUM_COLUMNS])
+{
+  uint64_t cycles = b->clock - a->clock;
+  values[COL_CYCLE] = b->clock;
+  values[COL_CYCLES] = cycles;
+  values[COL_INSTRUCTIONS] = b->instructions - a->instructions;
+  values[COL_IPC] = ratio(b->instructions - a->instructions, cycles);
+  values[COL_IQ] = ratio(b->iq - a->iq, cycles);
+  values[COL_ROB] = ratio(b->rob - a->rob, cycles);
+  values[COL_LSQ] = ratio(b->lsq - a->lsq, cycles);
+  values[COL_PRF] = ratio(b->prf - a->prf, cycles);
+  values[COL_BRANCHES] = b->branches - a->branches;
+  values[COL_MISPREDICTS] = b->mispredicts - a->mispredicts;
+  values[COL_MEM_OPS] = b->mem_ops - a->mem_ops;
+  values[COL_STALLS] = b->stalls - a->stalls;
+}
+
+/*
+ * Starts sampling the counters of cpu every config.interval cycles into
+ * config.samples. Returns NULL if the file cannot be created.
+ */
+APEX_Samples *
+APEX_samples_open(const APEX_CPU *cpu)
+{
+  const char *filename = cpu->config.samples;
+  size_t len = strlen(filename);
+  APEX_Samples *samples = calloc(1, sizeof(*samples));
+  if (!samples)
+  {
+    return NULL;
+  }
+  samples->csv = len > 4 && strcmp(filename + len - 4, ".csv") == 0;
+  samples->fp = fopen(filename, samples->csv ? "w" : "wb");
+  if (!samples->fp)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    free(samples);
+    return NULL;
+  }
+  samples->capacity = 64;
+  samples->rows = malloc(sizeof(*samples->rows) * samples->capacity);
+  if (!samples->rows)
+  {
+    fclose(samples->fp);
+    free(samples);
+    return NULL;
+  }
+  snapshot(cpu, &samples->rows[samples->count++]);
+  return samples;
+}
+
+/*
+ * Ends the interval at the current cycle and schedules the next one
+ */
+void APEX_samples_take(APEX_CPU *cpu)
+{
+  APEX_Samples *samples = cpu->samples;
+  cpu->next_sample = cpu->clock + cpu->config.interval;
+
+  if (samples->count == samples->capacity)
+  {
+    Sample *grown = realloc(samples->rows, sizeof(*grown) * samples->capacity * 2);
+    if (!grown)
+    {
+      samples->failed = 1;
+      return;
+    }
+    samples->rows = grown;
+    samples->capacity *= 2;
+  }
+  snapshot(cpu, &samples->rows[samples->count++]);
+}
+
+static int
+write_csv(const APEX_Samples *samples)
+{
+  double values[NUM_COLUMNS];
+  for (int c = 0; c < NUM_COLUMNS; ++c)
+  {
+    fprintf(samples->fp, "%s%s", c ? "," : "", column_names[c]);
+  }
+  fprintf(samples->fp, "\n");
+  for (int r = 1; r < samples->count; ++r)
+  {
+    interval_values(&samples->rows[r - 1], &samples->rows[r], values);
+    for (int c = 0; c < NUM_COLUMNS; ++c)
+    {
+      fprintf(samples->fp, "%s%.10g", c ? "," : "", values[c]);
+    }
+    fprintf(samples->fp, "\n");
+  }
+  return 0;
+}
+
+static int
+write_columns(const APEX_Samples *samples)
+{
+  Samples_Header header;
+  char name[16];
+  double values[NUM_COLUMNS];
+  int rows = samples->count - 1;
+  double *columns = malloc(sizeof(*columns) * NUM_COLUMNS * (rows ? rows : 1));
+  int ok = columns != NULL;
+
+  /* Transpose the rows into one array per column */
+  for (int r = 0; ok && r < rows; ++r)
+  {
+    interval_values(&samples->rows[r], &samples->rows[r + 1], values);
+    for (int c = 0; c < NUM_COLUMNS; ++c)
+    {
+      columns[(size_t)c * rows + r] = values[c];
+    }
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, samples_magic, sizeof(header.magic));
+  header.version = APEX_SAMPLES_VERSION;
+  header.columns = NUM_COLUMNS;
+  header.rows = rows;
+  ok = ok && fwrite(&header, sizeof(header), 1, samples->fp) == 1;
+  for (int c = 0; ok && c < NUM_COLUMNS; ++c)
+  {
+    memset(name, 0, sizeof(name));
+    strncpy(name, column_names[c], sizeof(name) - 1);
+    ok = fwrite(name, sizeof(name), 1, samples->fp) == 1;
+  }
+  ok = ok && fwrite(columns, sizeof(*columns) * NUM_COLUMNS, rows, samples->fp) ==
+                 (size_t)rows;
+  free(columns);
+  return ok ? 0 : -1;
+}
+
+/*
+ * Ends the last, possibly shorter, interval and writes every sample of
+ * the run. Returns 0 if they were all written.
+ */
+int APEX_samples_close(APEX_CPU *cpu)
+{
+  APEX_Samples *samples = cpu->samples;
+  int status;
+
+  if ((uint64_t)cpu->clock > samples->rows[samples->count - 1].clock)
+  {
+    APEX_samples_take(cpu);
+  }
+  status = samples->csv ? write_csv(samples) : write_columns(samples);
+  if (fclose(samples->fp) != 0 || samples->failed)
+  {
+    status = -1;
+  }
+  if (status != 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", cpu->config.samples);
+  }
+  free(samples->rows);
+  free(samples);
+  cpu->samples = NULL;
+  return status;
+}
@@ -0,0 +1,353 @@
+/*
+ *  sweep.c
+ *  Contains the sweep mode, which simulates one program under every
+ *  combination of a set of configuration values and prints a CSV row
+ *  for each
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+
+#define SWEEP_MAX_POINTS (1 << 20)
+
+/* A configuration key and the values it is swept over */
+typedef struct Sweep_Param
+{
+  char key[64];
+  char **values;
+  int count;
+} Sweep_Param;
+
+/* Outcome of simulating one design point */
+typedef struct Sweep_Point
+{
+  int loaded;       // CPU initialised
+  int halted;       // HALT retired before the cycle budget ran out
+  int instructions;
+  int cycles;
+  unsigned int mispredicts;
+  unsigned int stalls[NUM_STALLS];
+} Sweep_Point;
+
+/* Everything the jobs of a sweep share. Code memory is decoded once and
+ * read by every CPU.
+ */
+typedef struct Sweep_Run
+{
+  APEX_Instruction *code_memory;
+  int code_memory_size;
+  int no_of_cycles;
+  APEX_Config base;
+  Sweep_Param *params;
+  int nparams;
+  Sweep_Point *points;
+} Sweep_Run;
+
+/* Appends value to the values of param */
+static int
+add_value(Sweep_Param *param, const char *value, size_t len)
+{
+  char **grown = realloc(param->values, sizeof(*grown) * (param->count + 1));
+  if (!grown)
+  {
+    return -1;
+  }
+  param->values = grown;
+  param->values[param->count] = strndup(value, len);
+  return param->values[param->count++] ? 0 : -1;
+}
+
+/*
+ * Fills param with the values spec covers: a range lo:hi, lo:hi:step
+ * or lo:hi:*factor, or else a comma-separated list such as 4,8,16 or
+ * gshare,tage. A single value is a list of one.
+ */
+static int
+expand_values(Sweep_Param *param, const char *spec)
+{
+  char *end;
+  long lo = strtol(spec, &end, 0);
+
+  if (end != spec && *end == ':')
+  {
+    long hi = strtol(end + 1, &end, 0);
+    long step = 1;
+    int geometric = 0;
+    if (*end == ':')
+    {
+      geometric = end[1] == '*';
+      step = strtol(end + 1 + geometric, &end, 0);
+    }
+    if (*end != '\0' || hi < lo || step < 1 + geometric)
+    {
+      fprintf(stderr, "APEX_Error : %s: bad range '%s', expected lo:hi, lo:hi:step "
+                      "or lo:hi:*factor\n",
+              param->key, spec);
+      return -1;
+    }
+    for (long v = lo; v <= hi; v = geometric ? v * step : v + step)
+    {
+      char value[32];
+      if (param->count >= SWEEP_MAX_POINTS || (geometric && v == 0))
+      {
+        fprintf(stderr, "APEX_Error : %s: range '%s' has too many values\n",
+                param->key, spec);
+        return -1;
+      }
+      snprintf(value, sizeof(value), "%ld", v);
+      if (add_value(param, value, strlen(value)) != 0)
+      {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  for (const char *value = spec;;)
+  {
+    size_t len = strcspn(value, ",");
+    if (add_value(param, value, len) != 0)
+    {
+      return -1;
+    }
+    if (value[len] == '\0')
+    {
+      return 0;
+    }
+    value += len + 1;
+  }
+}
+
+/* Value of swept parameter p at design point index, the first
+ * parameter varying slowest
+ */
+static const char *
+point_value(const Sweep_Run *run, int index, int p)
+{
+  for (int q = run->nparams - 1; q > p; --q)
+  {
+    index /= run->params[q].count;
+  }
+  return run->params[p].values[index % run->params[p].count];
+}
+
+/* Configuration of design point index: the base configuration with the
+ * swept values applied
+ */
+static void
+point_config(const Sweep_Run *run, int index, APEX_Config *config)
+{
+  *config = run->base;
+  for (int p = 0; p < run->nparams; ++p)
+  {
+    APEX_config_set(config, run->params[p].key, point_value(run, index, p));
+  }
+}
+
+static void
+run_point(void *arg, int index)
+{
+  Sweep_Run *run = arg;
+  Sweep_Point *point = &run->points[index];
+  APEX_Config config;
+
+  point_config(run, index, &config);
+  APEX_CPU *cpu = APEX_cpu_init_code(run->code_memory, run->code_memory_size,
+                                     config.ff_insns || config.ff_pc ? "Fastforward"
+                                                                     : "Simulate",
+                                     run->no_of_cycles, &config);
+  if (!cpu)
+  {
+    return;
+  }
+  APEX_cpu_simulate(cpu);
+  point->loaded = 1;
+  point->halted = cpu->halted;
+  point->instructions = cpu->ins_completed;
+  point->cycles = cpu->clock - cpu->start_clock;
+  point->mispredicts = cpu->bp.mispredicts;
+  memcpy(point->stalls, cpu->stalls, sizeof(point->stalls));
+  APEX_cpu_stop(cpu);
+}
+
+static void
+print_csv(const Sweep_Run *run, int count)
+{
+  for (int p = 0; p < run->nparams; ++p)
+  {
+    printf("%s,", run->params[p].key);
+  }
+  printf("status,instructions,cycles,ipc,mispredicts,"
+         "stall_rob,stall_iq,stall_lsq,stall_prf,stall_bis\n");
+
+  for (int i = 0; i < count; ++i)
+  {
+    const Sweep_Point *point = &run->points[i];
+    for (int p = 0; p < run->nparams; ++p)
+    {
+      printf("%s,", point_value(run, i, p));
+    }
+    if (!point->loaded)
+    {
+      printf("error,,,,,,,,,\n");
+      continue;
+    }
+    printf("%s,%d,%d,%.4f,%u,%u,%u,%u,%u,%u\n", point->halted ? "halted" : "stopped",
+           point->instructions, point->cycles,
+           point->cycles ? (double)point->instructions / point->cycles : 0.0,
+           point->mispredicts, point->stalls[STALL_ROB], point->stalls[STALL_IQ],
+           point->stalls[STALL_LSQ], point->stalls[STALL_PRF], point->stalls[STALL_BIS]);
+  }
+}
+
+/*
+ * Parses the key=value params into run. Single values go straight into
+ * the base configuration, in order, so config=FILE can be overridden by
+ * later keys; only the swept parameters are kept in run->params.
+ * Returns the number of design points, or -1.
+ */
+static int
+parse_params(Sweep_Run *run, int nparams, const char *const *params)
+{
+  int count = 1;
+
+  APEX_config_default(&run->base);
+  run->params = calloc(nparams ? nparams : 1, sizeof(*run->params));
+  if (!run->params)
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < nparams; ++i)
+  {
+    Sweep_Param *param = &run->params[run->nparams];
+    const char *eq = strchr(params[i], '=');
+    if (!eq || eq == params[i] || (size_t)(eq - params[i]) >= sizeof(param->key))
+    {
+      fprintf(stderr, "APEX_Error : Expected key=value, got '%s'\n", params[i]);
+      return -1;
+    }
+    memcpy(param->key, params[i], eq - params[i]);
+    param->key[eq - params[i]] = '\0';
+    run->nparams++;
+    if (expand_values(param, eq + 1) != 0)
+    {
+      return -1;
+    }
+
+    if (param->count == 1)
+    {
+      if (APEX_config_set(&run->base, param->key, param->values[0]) != 0)
+      {
+        return -1;
+      }
+      free(param->values[0]);
+      free(param->values);
+      memset(param, 0, sizeof(*param));
+      run->nparams--;
+      continue;
+    }
+
+    /* Check every value up front rather than in the middle of the sweep */
+    for (int v = 0; v < param->count; ++v)
+    {
+      APEX_Config scratch = run->base;
+      if (APEX_config_set(&scratch, param->key, param->values[v]) != 0)
+      {
+        return -1;
+      }
+    }
+    if (count > SWEEP_MAX_POINTS / param->count)
+    {
+      fprintf(stderr, "APEX_Error : Sweep has more than %d points\n", SWEEP_MAX_POINTS);
+      return -1;
+    }
+    count *= param->count;
+  }
+
+  run->base.verbose = 0;
+  run->base.checkpoint[0] = '\0';
+  run->base.trace[0] = '\0';
+  run->base.stats[0] = '\0';
+  run->base.samples[0] = '\0';
+  return count;
+}
+
+/*
+ * Simulates the program in filename for up to no_of_cycles cycles under
+ * every combination of the key=value params, where a value may give
+ * several values to sweep over (see expand_values). The program is
+ * decoded once, the points run on threads=N host threads, and one CSV
+ * row per point goes to stdout. Returns 0 if every point ran.
+ */
+int APEX_sweep_run(const char *filename, int no_of_cycles, int nparams,
+                   const char *const *params)
+{
+  Sweep_Run run;
+  size_t mapped = 0;
+  int status = -1;
+
+  memset(&run, 0, sizeof(run));
+  run.no_of_cycles = no_of_cycles;
+  int count = parse_params(&run, nparams, params);
+
+  if (count > 0)
+  {
+    if (APEX_program_is_binary(filename))
+    {
+      run.code_memory = APEX_program_map(filename, &run.code_memory_size, &mapped);
+    }
+    else
+    {
+      run.code_memory = create_code_memory(filename, &run.code_memory_size, NULL);
+    }
+    run.points = calloc(count, sizeof(*run.points));
+  }
+
+  if (run.code_memory && run.points)
+  {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int threads = APEX_pool_run(count, run.base.threads, run_point, &run);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    print_csv(&run, count);
+
+    int failed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+      failed += !run.points[i].loaded;
+    }
+    fprintf(stderr, "(apex) >> Swept %d points on %d threads in %.3f s, %d failed\n",
+            count, threads,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, failed);
+    status = failed ? -1 : 0;
+  }
+
+  if (mapped)
+  {
+    APEX_program_unmap(run.code_memory, mapped);
+  }
+  else
+  {
+    free(run.code_memory);
+  }
+  for (int p = 0; p < run.nparams; ++p)
+  {
+    for (int v = 0; v < run.params[p].count; ++v)
+    {
+      free(run.params[p].values[v]);
+    }
+    free(run.params[p].values);
+  }
+  free(run.params);
+  free(run.points);
+  return status;
+}
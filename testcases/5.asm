@@ -1,8 +1,9 @@
+MOVC,R12,#4032 
 MOVC,R1,#2 
 MOVC,R2,#6 
 SUB,R2,R2,R1 
 BNZ,#-4 
-JUMP,#12
+JUMP,R12,#0
 ADD,R2,R2,R1
 ADD,R2,R2,R1
 HALT 
@@ -0,0 +1,454 @@
+/*
+ *  trace.c
+ *  Contains the pipeline trace: stage events rendered in the familiar
+ *  per-cycle format, or recorded into a compressed binary trace file by
+ *  a background writer thread
+ *
+ *  Author :
+ *  Carolina Hernandez (cherna19@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "cpu.h"
+
+static const char trace_magic[8] = "APEXTRCE";
+
+#define TRACE_RING_RECORDS (1 << 16) // Power of two
+#define TRACE_RING_MASK (TRACE_RING_RECORDS - 1)
+#define TRACE_WRITE_RECORDS 4096     // Most records handed to zlib at once
+
+/*
+ * Trace file layout, a gzip stream of:
+ *
+ *   header
+ *   APEX_Instruction[code_memory_size]  code memory, to render from
+ *   APEX_Trace_Record ...               until the end of the stream
+ */
+typedef struct Trace_Header
+{
+  char magic[8];
+  uint32_t version;           // APEX_TRACE_VERSION
+  uint32_t record_size;       // sizeof(APEX_Trace_Record) of the writer
+  uint32_t instruction_size;  // sizeof(APEX_Instruction) of the writer
+  uint32_t code_memory_size;  // Instructions following the header
+  int32_t fu_units[NUM_FU_CLASSES];
+  int32_t fu_latency[NUM_FU_CLASSES];
+} Trace_Header;
+
+/*
+ * Single-producer, single-consumer ring between the simulation and the
+ * writer thread. Each side owns one counter and only reads the other,
+ * so neither ever takes a lock; the counters sit on their own cache
+ * lines so the two threads do not keep stealing one line from each
+ * other.
+ */
+struct APEX_Trace
+{
+  APEX_Trace_Record ring[TRACE_RING_RECORDS];
+
+  _Alignas(64) atomic_uint tail; // Next record the simulation writes
+  unsigned int head_seen;        // Simulation's last look at head
+
+  _Alignas(64) atomic_uint head; // Next record the writer compresses
+  atomic_int done;               // Simulation has finished recording
+
+  gzFile file;
+  pthread_t writer;
+  int failed; // A write to file failed
+};
+
+/* Writer thread: compresses whatever the simulation has published, and
+ * naps when it has caught up
+ */
+static void *
+trace_writer(void *arg)
+{
+  APEX_Trace *trace = arg;
+  unsigned int head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+  for (;;)
+  {
+    int done = atomic_load_explicit(&trace->done, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+
+    if (head == tail)
+    {
+      if (done)
+      {
+        return NULL;
+      }
+      struct timespec nap = {0, 200000};
+      nanosleep(&nap, NULL);
+      continue;
+    }
+
+    /* Stop at the end of the ring, the rest follows next time round */
+    unsigned int n = tail - head;
+    unsigned int contiguous = TRACE_RING_RECORDS - (head & TRACE_RING_MASK);
+    if (n > contiguous)
+    {
+      n = contiguous;
+    }
+    if (n > TRACE_WRITE_RECORDS)
+    {
+      n = TRACE_WRITE_RECORDS;
+    }
+    if (!trace->failed &&
+        gzwrite(trace->file, &trace->ring[head & TRACE_RING_MASK],
+                n * sizeof(APEX_Trace_Record)) != (int)(n * sizeof(APEX_Trace_Record)))
+    {
+      trace->failed = 1;
+    }
+    head += n;
+    atomic_store_explicit(&trace->head, head, memory_order_release);
+  }
+}
+
+/*
+ * Creates filename and starts recording the pipeline of cpu into it.
+ * Returns NULL if the file cannot be written.
+ */
+APEX_Trace *
+APEX_trace_open(const char *filename, const APEX_CPU *cpu)
+{
+  APEX_Trace *trace = aligned_alloc(64, sizeof(*trace));
+  if (!trace)
+  {
+    fprintf(stderr, "APEX_Error : Out of memory for trace\n");
+    return NULL;
+  }
+  memset(trace, 0, sizeof(*trace));
+
+  /* Speed over ratio, the writer has to keep up with the simulation */
+  trace->file = gzopen(filename, "wb1");
+  if (!trace->file)
+  {
+    fprintf(stderr, "APEX_Error : Unable to create trace %s\n", filename);
+    free(trace);
+    return NULL;
+  }
+
+  Trace_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, trace_magic, sizeof(header.magic));
+  header.version = APEX_TRACE_VERSION;
+  header.record_size = sizeof(APEX_Trace_Record);
+  header.instruction_size = sizeof(APEX_Instruction);
+  header.code_memory_size = cpu->code_memory_size;
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    header.fu_units[fu] = cpu->config.fu_units[fu];
+    header.fu_latency[fu] = cpu->config.fu_latency[fu];
+  }
+
+  size_t code_bytes = cpu->code_memory_size * sizeof(APEX_Instruction);
+  if (gzwrite(trace->file, &header, sizeof(header)) != (int)sizeof(header) ||
+      gzwrite(trace->file, cpu->code_memory, code_bytes) != (int)code_bytes ||
+      pthread_create(&trace->writer, NULL, trace_writer, trace) != 0)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write trace %s\n", filename);
+    gzclose(trace->file);
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+/*
+ * Appends one record. Only blocks when the writer has fallen a whole
+ * ring behind.
+ */
+void APEX_trace_record(APEX_Trace *trace, const APEX_Trace_Record *record)
+{
+  unsigned int tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+  while (tail - trace->head_seen == TRACE_RING_RECORDS)
+  {
+    trace->head_seen = atomic_load_explicit(&trace->head, memory_order_acquire);
+    if (tail - trace->head_seen == TRACE_RING_RECORDS)
+    {
+      sched_yield();
+    }
+  }
+  trace->ring[tail & TRACE_RING_MASK] = *record;
+  atomic_store_explicit(&trace->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Waits for the writer to drain the ring, then finishes the file.
+ * Returns 0 if every record made it to disk.
+ */
+int APEX_trace_close(APEX_Trace *trace)
+{
+  atomic_store_explicit(&trace->done, 1, memory_order_release);
+  pthread_join(trace->writer, NULL);
+  int failed = gzclose(trace->file) != Z_OK || trace->failed;
+  free(trace);
+  if (failed)
+  {
+    fprintf(stderr, "APEX_Error : Unable to write trace\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Prints the trace in filename the way the simulator prints a run with
+ * verbose=1: code memory, then every cycle. Returns 0 if the whole trace
+ * was read.
+ */
+int APEX_trace_render(const char *filename)
+{
+  gzFile file = gzopen(filename, "rb");
+  Trace_Header header;
+  if (!file)
+  {
+    fprintf(stderr, "APEX_Error : Unable to open trace %s\n", filename);
+    return -1;
+  }
+  if (gzread(file, &header, sizeof(header)) != (int)sizeof(header) ||
+      memcmp(header.magic, trace_magic, sizeof(header.magic)) != 0)
+  {
+    fprintf(stderr, "APEX_Error : %s is not an APEX trace\n", filename);
+    gzclose(file);
+    return -1;
+  }
+  if (header.version != APEX_TRACE_VERSION ||
+      header.record_size != sizeof(APEX_Trace_Record) ||
+      header.instruction_size != sizeof(APEX_Instruction))
+  {
+    fprintf(stderr, "APEX_Error : Trace %s was written by version %u of the simulator, "
+                    "this is version %d\n",
+            filename, header.version, APEX_TRACE_VERSION);
+    gzclose(file);
+    return -1;
+  }
+
+  /* Stage names only depend on the functional unit layout */
+  APEX_Config config;
+  memset(&config, 0, sizeof(config));
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    config.fu_units[fu] = header.fu_units[fu];
+    config.fu_latency[fu] = header.fu_latency[fu];
+  }
+
+  size_t code_bytes = (size_t)header.code_memory_size * sizeof(APEX_Instruction);
+  APEX_Instruction *code_memory = malloc(code_bytes ? code_bytes : 1);
+  APEX_Trace_Record *records = malloc(sizeof(*records) * TRACE_WRITE_RECORDS);
+  int status = -1;
+
+  if (code_memory && records &&
+      gzread(file, code_memory, code_bytes) == (int)code_bytes)
+  {
+    int bytes;
+    APEX_print_code_memory(code_memory, header.code_memory_size);
+    while ((bytes = gzread(file, records, sizeof(*records) * TRACE_WRITE_RECORDS)) > 0)
+    {
+      for (int i = 0; i < bytes / (int)sizeof(*records); ++i)
+      {
+        APEX_trace_print(&records[i], code_memory, header.code_memory_size, &config);
+      }
+      if (bytes % sizeof(*records))
+      {
+        break;
+      }
+    }
+    status = bytes == 0 ? 0 : -1;
+  }
+  if (status != 0)
+  {
+    fprintf(stderr, "APEX_Error : Trace %s is truncated\n", filename);
+  }
+  free(records);
+  free(code_memory);
+  gzclose(file);
+  return status;
+}
+
+/*
+ * Prints code memory as the table the simulator shows at startup
+ */
+void APEX_print_code_memory(const APEX_Instruction *code_memory, int size)
+{
+  fprintf(stderr, "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n", size);
+  fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
+  printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "rs3", "imm");
+
+  for (int i = 0; i < size; ++i)
+  {
+    printf("%-9s %-9d %-9d %-9d %-9d %-9d\n",
+           apex_opcode_info[code_memory[i].opcode].name,
+           code_memory[i].rd,
+           code_memory[i].rs1,
+           code_memory[i].rs2,
+           code_memory[i].rs3,
+           code_memory[i].imm);
+  }
+}
+
+static void
+print_instruction(const APEX_Trace_Record *record, const APEX_Instruction *ins, int renamed)
+{
+  const char *name = apex_opcode_info[record->opcode].name;
+
+  switch (apex_opcode_info[record->opcode].format)
+  {
+  case FMT_RS1_RS2_IMM:
+    printf("%s,R%d,R%d,#%d ", name, ins->rs1, ins->rs2, ins->imm);
+    if (renamed)
+    {
+      printf("-> [%s,P%d,P%d,#%d] ", name, record->p1, record->p2, ins->imm);
+    }
+    break;
+
+  case FMT_RD_IMM:
+    printf("%s,R%d,#%d ", name, ins->rd, ins->imm);
+    if (renamed)
+    {
+      printf("-> [%s,P%d,#%d] ", name, record->prd, ins->imm);
+    }
+    break;
+
+  case FMT_RS1_RS2_RS3:
+    printf("%s,R%d,R%d,R%d ", name, ins->rs1, ins->rs2, ins->rs3);
+    if (renamed)
+    {
+      printf("-> [%s,P%d,P%d,P%d] ", name, record->p1, record->p2, record->p3);
+    }
+    break;
+
+  case FMT_RD_RS1_RS2:
+    printf("%s,R%d,R%d,R%d ", name, ins->rd, ins->rs1, ins->rs2);
+    if (renamed)
+    {
+      printf("-> [%s,P%d,P%d,P%d] ", name, record->prd, record->p1, record->p2);
+    }
+    break;
+
+  case FMT_RD_RS1_IMM:
+    printf("%s,R%d,R%d,#%d ", name, ins->rd, ins->rs1, ins->imm);
+    if (renamed)
+    {
+      printf("-> [%s,P%d,P%d,#%d] ", name, record->prd, record->p1, ins->imm);
+    }
+    break;
+
+  case FMT_IMM:
+    printf("%s,#%d", name, ins->imm);
+    break;
+
+  case FMT_RS1_IMM:
+    printf("%s,R%d,#%d", name, ins->rs1, ins->imm);
+    if (renamed)
+    {
+      printf(" -> [%s,P%d,#%d]", name, record->p1, ins->imm);
+    }
+    break;
+
+  case FMT_NONE:
+    if (record->opcode == OP_HALT)
+    {
+      printf("%s", name);
+    }
+    break;
+
+  case NUM_FORMATS:
+    break;
+  }
+}
+
+/* Name of the functional unit latch in record: INT1_FU_STAGE,
+ * MUL3_FU_STAGE, BR_FU_STAGE and so on. The stage number is left out of
+ * single-stage units, and the unit number is added when its class has
+ * more than one.
+ */
+static void
+fu_stage_name(const APEX_Trace_Record *record, const APEX_Config *config, char *name,
+              size_t size)
+{
+  static const char *const prefix[NUM_FU_CLASSES] = {
+      [FU_INT] = "INT", [FU_MUL] = "MUL", [FU_BR] = "BR"};
+  int fu = TRACE_UNIT_CLASS(record->unit);
+  char number[12] = "";
+  char unit[12] = "";
+
+  if (fu >= NUM_FU_CLASSES || !prefix[fu])
+  {
+    snprintf(name, size, "FU?");
+    return;
+  }
+  if (config->fu_latency[fu] > 1)
+  {
+    snprintf(number, sizeof(number), "%d", record->latch + 1);
+  }
+  if (config->fu_units[fu] > 1)
+  {
+    snprintf(unit, sizeof(unit), "%d", TRACE_UNIT_INSTANCE(record->unit));
+  }
+  snprintf(name, size, "%s%s_FU%s_STAGE", prefix[fu], number, unit);
+}
+
+/*
+ * Prints one trace record in the per-cycle format of verbose=1. config
+ * supplies the functional unit layout.
+ */
+void APEX_trace_print(const APEX_Trace_Record *record, const APEX_Instruction *code_memory,
+                      int code_memory_size, const APEX_Config *config)
+{
+  char name[32];
+
+  switch (record->event)
+  {
+  case TRACE_CYCLE:
+    printf("--------------------------------\n");
+    printf("Clock Cycle #: %d\n", record->clock);
+    printf("--------------------------------\n");
+    return;
+
+  case TRACE_IDLE:
+    printf("--------------------------------\n");
+    printf("Clock Cycle #: %d-%d idle\n", record->clock, record->pc);
+    printf("--------------------------------\n");
+    return;
+
+  case TRACE_FETCH:
+    strcpy(name, "Fetch");
+    break;
+
+  case TRACE_DECODE:
+  case TRACE_DECODE_STALLED:
+    strcpy(name, "Decode/Rename");
+    break;
+
+  case TRACE_FU:
+    fu_stage_name(record, config, name, sizeof(name));
+    break;
+
+  case TRACE_MEMORY:
+    strcpy(name, "Memory");
+    break;
+
+  default:
+    return;
+  }
+
+  /* Tags are only meaningful once decode has renamed the instruction */
+  int renamed = record->event != TRACE_FETCH && record->event != TRACE_DECODE_STALLED;
+  unsigned int index = (unsigned)(record->pc - 4000) / 4;
+
+  printf("%-15s: pc(%d) ", name, record->pc);
+  if (record->pc >= 4000 && index < (unsigned)code_memory_size)
+  {
+    print_instruction(record, &code_memory[index], renamed);
+  }
+  printf("\n");
+}